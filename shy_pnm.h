@@ -17,6 +17,298 @@ USAGE:
         w and h are integers destinations for the width and height of the image
         pix is a pointer to the newly allocated pixel data, in 32-bit RGBA form
 
+        Large files can be loaded faster with
+
+        uint32_t *pix = PnmLoadMapped(filename, &w, &h);
+
+        which takes the same arguments as PnmLoad(), but maps the file into
+        memory and parses it in place rather than reading it through stdio.
+        On platforms without mmap() it behaves exactly like PnmLoad().
+
+        PNM data which is already in memory can be decoded with
+
+        uint32_t *pix = PnmLoadMemory(data, len, &w, &h);
+
+        where data points to the first byte of the file contents and len is
+        the number of bytes available. Decoding never reads past data + len.
+
+        Binary images can be decoded by several threads at once with
+
+        uint32_t *pix = PnmLoadParallel(filename, &w, &h, nthreads);
+
+        which splits the image into bands of rows, one per thread. If
+        nthreads is 0, one thread per online processor is used. Plain (ASCII)
+        images are split into chunks of text, which are tokenized and
+        converted in parallel.
+
+        A rectangle of an image can be loaded with
+
+        uint32_t *pix = PnmLoadRegion(filename, x, y, rw, rh, &w, &h);
+
+        which decodes the rw by rh pixels whose top-left corner is at (x, y).
+        The region is clipped to the image, and its final size stored in w
+        and h. Only the bytes of the region are read from binary images,
+        while plain images are decoded up to the last row of the region.
+
+        Images too large to hold in memory can be decoded a few rows at a
+        time with
+
+        PnmSource src = {.filename = filename};
+        int ok = PnmStreamRows(&src, callback, user);
+
+        A source names a file with filename, an open file with file (read
+        from its current position), or a range of memory with data and
+        size; only one of these should be set. The callback is called as
+
+        int callback(void *user, const uint32_t *pix, int w, int h,
+                     int y, int rows);
+
+        with pix holding rows w-pixel rows of the w by h image, starting at
+        row y, in the same form as PnmLoad(). pix is only valid until the
+        callback returns, and only a row's worth of the image (about 64kB)
+        is held in memory at once. The callback returns nonzero to carry on,
+        or 0 to stop decoding. PnmStreamRows() returns 1 once every row has
+        been passed to the callback, and 0 on errors or if it was stopped.
+
+        Images can be decoded into other pixel formats with
+
+        void *pix = PnmLoadEx(&src, format, &w, &h);
+
+        where format is one of
+
+        PNM_RGBA32      32-bit RGBA words, as PnmLoad()
+        PNM_GRAY8       one byte of gray per pixel
+        PNM_GRAY16      one uint16_t of gray per pixel
+        PNM_RGB8        red, green and blue bytes
+        PNM_RGBA8       red, green, blue and alpha bytes
+        PNM_RGB16       red, green and blue uint16_t values
+        PNM_RGBA16      red, green, blue and alpha uint16_t values
+        PNM_BIT1        bitmap rows of (w + 7) / 8 bytes, with the most
+                        significant bit first and 1 for black, as in PBM
+
+        8-bit formats are scaled to 0-255 and 16-bit formats to 0-65535
+        (in host byte order), so 16-bit images keep their full precision.
+        Grayscale images are copied into every color channel, color images
+        are reduced to luma, and images without alpha are opaque. Any image
+        can be loaded as a bitmap, in which pixels darker than half
+        intensity are black.
+
+        To decode into memory owned by the caller instead, use
+
+        int w = maxw, h = maxh;
+        int ok = PnmLoadInto(&src, dst, stride, format, &w, &h);
+
+        where w and h first give the size of the destination in pixels, and
+        stride is the distance in bytes between the starts of its rows (0
+        for rows packed one after another). On success, 1 is returned and
+        the size of the image is stored in w and h. Images larger than the
+        destination are not loaded, and 0 is returned. For 16-bit and
+        RGBA32 formats, dst and stride should keep rows aligned to their
+        sample size.
+
+        The header of an image can be read without decoding it with
+
+        PnmInfo info;
+        int ok = PnmProbe(&src, &info);
+
+        which returns 1 and fills in info if the header is valid, and 0
+        otherwise. info.magic is the format digit ('1' to '7'), followed by
+        the width, height, depth and maxval, and the tuple type (PBM, PGM
+        and PPM images are described like the equivalent PAM images, and
+        long tuple types are truncated). info.offset is the offset of the
+        raster from the start of the source, and info.size is the size of
+        the raster in bytes, or 0 for plain images whose size depends on
+        their formatting. Files given by file are left at the start of the
+        raster.
+
+        Images arriving in pieces, such as from a socket, can be decoded as
+        the data comes in with a push decoder:
+
+        PnmDecoder *dec = PnmDecoderCreate();
+        ptrdiff_t used = PnmDecoderFeed(dec, buf, len);
+
+        The data may be split anywhere, even within a header token or a
+        comment. PnmDecoderFeed() returns the number of bytes it used, which
+        is len unless the image ended within buf (the remaining bytes may
+        belong to the next image), or -1 on errors.
+
+        int rows = PnmDecoderRowsReady(dec);
+        const uint32_t *pix = PnmDecoderPixels(dec, &w, &h);
+
+        give the number of rows decoded so far, and the pixels of the whole
+        image, of which the first rows are ready. pix is NULL until the
+        header has been read. Finally,
+
+        uint32_t *pix = PnmDecoderFinish(dec, &w, &h);
+
+        destroys the decoder, returning the image as PnmLoad() would if it
+        was complete, and NULL otherwise.
+
+        Files and pipes holding several images one after another, such as
+        the output of ffmpeg -f image2pipe -vcodec ppm, are read with
+
+        PnmStream *stream = PnmStreamOpen(&src);
+        while ((pix = PnmStreamNext(stream, &w, &h))) {
+                ...
+        }
+        PnmStreamClose(stream);
+
+        PnmStreamNext() returns the next image in the same form as
+        PnmLoad(), in a buffer owned by the stream which is reused for
+        every image that fits in it, so pix is only valid until the next
+        call. At the end of the stream it returns NULL and sets w and h to
+        0, while on errors it returns NULL and sets them to -1. Files are
+        never read past the end of the current image, so images are
+        returned as soon as they arrive through a pipe.
+
+        Images are saved with
+
+        PnmInfo info = {.magic = '6', .w = w, .h = h};
+        int ok = PnmSave(filename, &info, pix, stride, format);
+
+        or into a newly allocated buffer of len bytes with
+
+        void *data = PnmSaveMemory(&info, pix, stride, format, &len);
+
+        where pix holds the image in one of the formats of PnmLoadEx(), and
+        stride is the distance in bytes between the starts of its rows (0
+        for rows packed one after another). info describes the file, as
+        filled in by PnmProbe(): magic is the format digit, from '1' to
+        '7', w and h the size of the image, and maxval the largest sample
+        value. Samples are written as 16-bit values if maxval is over 255,
+        and if maxval is 0 it is chosen to keep the precision of format.
+        For PAM images, depth gives the number of channels, or 0 for those
+        of format, and tupltype names them, or is empty to name them from
+        the depth. Pixels are converted as for PnmLoadEx(), and rescaled so
+        that an image saved with the maxval it was loaded from is
+        unchanged. PnmSave() returns 1 on success and 0 on errors, while
+        PnmSaveMemory() returns NULL.
+
+        Many files can be loaded at once with
+
+        PnmImage results[n];
+        PnmBatchOptions opts = {.format = format};
+        int loaded = PnmLoadBatch(paths, n, results, &opts);
+
+        which loads each of the n files named by paths as PnmLoadEx() would,
+        storing its pixels and size in the matching entry of results, and
+        returns the number of files loaded. Files which could not be loaded
+        are left with NULL pixels and a size of -1. Each file is read whole
+        and decoded by one of opts.nthreads threads (0 for one per online
+        processor) as soon as its last byte has arrived. On Linux, files are
+        opened and read through io_uring, keeping up to opts.depth files
+        (0 for 64) in flight, and elsewhere, or if SHY_PNM_NO_IO_URING is
+        defined, the threads read the files themselves. The threads also
+        read any file the ring fails to, so a failing ring costs speed but
+        no files. opts may be NULL to use the defaults.
+
+        Files can be loaded in the background with
+
+        PnmAsyncOptions opts = {.format = format};
+        uint64_t id = PnmLoadAsync(filename, &opts, callback, user);
+
+        which queues the file to be loaded as PnmLoadEx() would by a pool of
+        worker threads, and returns at once with an id for the load, or 0
+        if it could not be queued. Once the file is loaded, one of the
+        workers calls
+
+        void callback(void *user, void *pix, int w, int h);
+
+        with the image, which the callback takes ownership of. On errors pix
+        is NULL and w and h are -1. The pool is started by the first load,
+        with opts.nthreads workers (0 for one per online processor), which
+        is also the most files decoded at once, and room for opts.maxqueued
+        loads (0 for 1024) waiting for a worker, beyond which PnmLoadAsync()
+        fails rather than block. opts may be NULL to use the defaults.
+
+        int ok = PnmAsyncCancel(id);
+
+        cancels a load, returning 1 if its callback has not yet been called,
+        in which case it is called with NULL pixels and a size of 0. Loads
+        which have not started are cancelled at once, from the calling
+        thread, while loads already running finish but have their pixels
+        discarded. Finally,
+
+        PnmAsyncShutdown();
+
+        cancels every queued load, waits for the running ones, and stops
+        the workers. It must not be called from a callback. Without threads,
+        PnmLoadAsync() loads the file before returning.
+
+        Images used again and again can be kept decoded in memory with
+
+        const void *pix = PnmCacheLoad(filename, format, &w, &h);
+
+        which loads the file as PnmLoadEx() would the first time, and
+        afterwards returns the same pixels for as long as the file keeps
+        its inode, modification time and size. The pixels are shared by
+        every caller and must not be modified. Each successful call should
+        be matched by
+
+        PnmCacheRelease(pix);
+
+        rather than PnmFree(). The least recently used images are evicted
+        once the cache holds more than 64MB, or the budget set with
+
+        PnmCacheSetBudget(bytes);
+
+        though images in use are only evicted after they are released.
+        PnmCacheClear() empties the cache. Without threads, nothing is
+        cached.
+
+        If SHY_PNM_STATS is defined before the implementation is included,
+        each thread keeps statistics of the loads it runs, which
+
+        PnmStats stats;
+        PnmGetStats(&stats);
+
+        returns, and PnmResetStats() sets back to zero. The fields are
+
+        open_ns      time spent opening files
+        header_ns    time spent parsing headers
+        alloc_ns     time spent allocating memory
+        table_ns     time spent building rescaling tables
+        decode_ns    time spent decoding and rescaling pixels
+        bytes_read   bytes read from files
+        io_calls     calls made to open, read or map files
+        alloc_bytes  bytes allocated
+        simd         widest SIMD used: 0 for none, 1 for SSSE3, 2 for AVX2
+        threads      most threads used by a single load
+
+        with times in nanoseconds. Counters from the threads started by
+        PnmLoadParallel() and PnmLoadBatch() are added to the caller's,
+        while loads from PnmLoadAsync() are counted by the workers. Without
+        SHY_PNM_STATS, PnmGetStats() returns zeroes.
+
+        Pixels returned by any of these functions should be released with
+
+        PnmFree(pix);
+
+        Memory is allocated with malloc() and released with free() unless
+        all three of
+
+                #define SHY_MALLOC(size) ...
+                #define SHY_REALLOC(ptr, size) ...
+                #define SHY_FREE(ptr) ...
+
+        are defined before the implementation is included, in which case
+        they are used instead. An allocator can also be chosen at runtime
+        with
+
+        ShyAllocator allocator = {alloc, resize, release, ctx};
+        PnmSetAllocator(&allocator);
+
+        after which memory is allocated as alloc(ctx, size), grown as
+        resize(ctx, ptr, size) and released as release(ctx, ptr), until
+        PnmSetAllocator(NULL) restores the default. alloc and release must
+        both be set, or the allocator is rejected and the current one kept;
+        resize may be NULL, in which case buffers are grown with alloc and
+        release. The allocator is shared by every thread, so it must be
+        thread-safe for PnmLoadParallel(), and should not be changed while
+        pixels or decoders allocated from it are still in use. Lookup tables
+        and images cached between loads and the queues of PnmLoadAsync() are
+        always taken from the default allocator.
+
 
 LICENSE:
         This library is in the public domain, no rights reserved. See full
@@ -26,9 +318,147 @@ LICENSE:
 #ifndef SHY_PNM_H
 #define SHY_PNM_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+	const char *filename;
+	FILE *      file;
+	const void *data;
+	size_t      size;
+} PnmSource;
+
+typedef int (*PnmRowCallback)(
+    void *user, const uint32_t *pix, int w, int h, int y, int rows);
+
+typedef struct PnmDecoder PnmDecoder;
+typedef struct PnmStream  PnmStream;
+
+#ifndef SHY_ALLOCATOR_DEFINED
+#define SHY_ALLOCATOR_DEFINED
+typedef struct {
+	void *(*alloc)(void *ctx, size_t size);
+	void *(*resize)(void *ctx, void *ptr, size_t size);
+	void (*release)(void *ctx, void *ptr);
+	void *ctx;
+} ShyAllocator;
+#endif
+
+enum PnmFormat {
+	PNM_RGBA32,
+	PNM_GRAY8,
+	PNM_GRAY16,
+	PNM_RGB8,
+	PNM_RGBA8,
+	PNM_RGB16,
+	PNM_RGBA16,
+	PNM_BIT1
+};
+
+typedef struct {
+	void *pix;
+	int   w;
+	int   h;
+} PnmImage;
+
+typedef struct {
+	uint64_t open_ns;
+	uint64_t header_ns;
+	uint64_t alloc_ns;
+	uint64_t table_ns;
+	uint64_t decode_ns;
+	uint64_t bytes_read;
+	uint64_t io_calls;
+	uint64_t alloc_bytes;
+	int      simd;
+	int      threads;
+} PnmStats;
+
+typedef struct {
+	int format;
+	int nthreads;
+	int depth;
+} PnmBatchOptions;
+
+typedef void (*PnmLoadCallback)(void *user, void *pix, int w, int h);
+
+typedef struct {
+	int format;
+	int nthreads;
+	int maxqueued;
+} PnmAsyncOptions;
+
+typedef struct {
+	int      magic;
+	int      w;
+	int      h;
+	int      depth;
+	int      maxval;
+	char     tupltype[32];
+	uint64_t offset;
+	uint64_t size;
+} PnmInfo;
 
 uint32_t *PnmLoad(const char *filename, int *w, int *h);
+uint32_t *PnmLoadMapped(const char *filename, int *w, int *h);
+uint32_t *PnmLoadMemory(const void *data, size_t len, int *w, int *h);
+uint32_t *PnmLoadParallel(const char *filename, int *w, int *h, int nthreads);
+uint32_t *PnmLoadRegion(
+    const char *filename, int x, int y, int rw, int rh, int *w, int *h);
+int PnmStreamRows(const PnmSource *source, PnmRowCallback callback, void *user);
+int PnmProbe(const PnmSource *source, PnmInfo *info);
+void *PnmLoadEx(const PnmSource *source, int format, int *w, int *h);
+int   PnmLoadInto(const PnmSource *source,
+                  void *           dst,
+                  size_t           stride,
+                  int              format,
+                  int *            w,
+                  int *            h);
+
+PnmDecoder *    PnmDecoderCreate(void);
+ptrdiff_t       PnmDecoderFeed(PnmDecoder *dec, const void *buf, size_t len);
+int             PnmDecoderRowsReady(const PnmDecoder *dec);
+const uint32_t *PnmDecoderPixels(const PnmDecoder *dec, int *w, int *h);
+uint32_t *      PnmDecoderFinish(PnmDecoder *dec, int *w, int *h);
+
+PnmStream *     PnmStreamOpen(const PnmSource *source);
+const uint32_t *PnmStreamNext(PnmStream *stream, int *w, int *h);
+void            PnmStreamClose(PnmStream *stream);
+
+int   PnmSave(const char *   filename,
+              const PnmInfo *info,
+              const void *   pix,
+              size_t         stride,
+              int            format);
+void *PnmSaveMemory(const PnmInfo *info,
+                    const void *   pix,
+                    size_t         stride,
+                    int            format,
+                    size_t *       len);
+
+int PnmLoadBatch(const char *const *    paths,
+                 int                    n,
+                 PnmImage *             results,
+                 const PnmBatchOptions *opts);
+
+uint64_t PnmLoadAsync(const char *           path,
+                      const PnmAsyncOptions *opts,
+                      PnmLoadCallback        callback,
+                      void *                 user);
+int      PnmAsyncCancel(uint64_t id);
+void     PnmAsyncShutdown(void);
+
+const void *PnmCacheLoad(const char *filename, int format, int *w, int *h);
+void        PnmCacheRelease(const void *pix);
+void        PnmCacheSetBudget(size_t bytes);
+void        PnmCacheClear(void);
+
+void PnmGetStats(PnmStats *stats);
+void PnmResetStats(void);
+
+void PnmSetAllocator(const ShyAllocator *allocator);
+void PnmFree(void *pix);
 
 #ifdef SHY_PNM_IMPLEMENTATION
 
@@ -39,69 +469,464 @@ uint32_t *PnmLoad(const char *filename, int *w, int *h);
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+// POSIX facilities (mmap, pread and threads) are used where the platform
+// declares them, which on glibc excludes strict ISO modes such as -std=c99
+// unless a feature test macro like _POSIX_C_SOURCE is defined.
+#if (defined(__unix__) || defined(__APPLE__))                                  \
+    && (!defined(__STRICT_ANSI__) || defined(__APPLE__)                        \
+        || defined(_POSIX_C_SOURCE) || defined(_XOPEN_SOURCE)                  \
+        || defined(_DEFAULT_SOURCE) || defined(_GNU_SOURCE))
+#define SHYPNM_HAVE_MMAP
+#define SHYPNM_HAVE_PTHREADS
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// io_uring is used for batches of files on Linux, when the kernel headers
+// are installed. Define SHY_PNM_NO_IO_URING to read them with threads alone.
+// The ring also needs syscall() and MAP_POPULATE, which glibc hides whenever
+// a feature test macro such as _POSIX_C_SOURCE asks for plain POSIX, so the
+// latter is checked for as a sign that both are declared.
+#if defined(SHYPNM_HAVE_PTHREADS) && defined(__linux__)                        \
+    && !defined(SHY_PNM_NO_IO_URING) && defined(__has_include)                 \
+    && defined(MAP_POPULATE)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#ifdef __NR_io_uring_setup
+#define SHYPNM_HAVE_IO_URING
+#endif
+#endif
+#endif
+
+// SIMD kernels are compiled with per-function target attributes and selected
+// at runtime, so no special compiler flags are needed to build them. Define
+// SHY_PNM_NO_SIMD to use only the portable scalar code.
+#if !defined(SHY_PNM_NO_SIMD) && defined(__GNUC__)                            \
+    && (defined(__x86_64__) || defined(__i386__))
+#define SHYPNM_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+enum SHYPNM_SimdLevel {
+	SHYPNM_SIMDNONE  = 0,
+	SHYPNM_SIMDSSSE3 = 1,
+	SHYPNM_SIMDAVX2  = 2
+};
+
+int SHYPNM_SimdLevel(void)
+{
+#ifdef SHYPNM_HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return SHYPNM_SIMDAVX2;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		return SHYPNM_SIMDSSSE3;
+	}
+#endif
+	return SHYPNM_SIMDNONE;
+}
+
+// Statistics are kept for each thread when SHY_PNM_STATS is defined, and cost
+// nothing otherwise. Time is charged to one phase at a time, so a phase entered
+// within another, such as an allocation made while decoding, is only counted
+// once. Work done by the threads of a parallel load is counted in the thread
+// which started it, where the load is timed as a whole.
+#ifdef SHY_PNM_STATS
+
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define SHYPNM_THREADLOCAL _Thread_local
+#else
+#define SHYPNM_THREADLOCAL __thread
+#endif
+
+enum SHYPNM_Phase {
+	SHYPNM_PHASENONE,
+	SHYPNM_PHASEOPEN,
+	SHYPNM_PHASEHEADER,
+	SHYPNM_PHASEALLOC,
+	SHYPNM_PHASETABLE,
+	SHYPNM_PHASEDECODE,
+	SHYPNM_PHASES
+};
+
+typedef struct {
+	uint64_t ns[SHYPNM_PHASES];
+	uint64_t since;
+	int      phase;
+	uint64_t bytes_read;
+	uint64_t io_calls;
+	uint64_t alloc_bytes;
+	int      simd;
+	int      threads;
+} SHYPNM_StatState;
+
+SHYPNM_THREADLOCAL SHYPNM_StatState SHYPNM_Stats;
+
+uint64_t SHYPNM_Clock(void)
+{
+#ifdef SHYPNM_HAVE_MMAP
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#else
+	return (uint64_t)((double)clock() * 1e9 / CLOCKS_PER_SEC);
+#endif
+}
+
+int SHYPNM_StatPhase(int phase)
+{
+	// Charges the time since the last change of phase to the current
+	// phase, and switches to the given one, returning the previous.
+	uint64_t now  = SHYPNM_Clock();
+	int      prev = SHYPNM_Stats.phase;
+
+	SHYPNM_Stats.ns[prev] += now - SHYPNM_Stats.since;
+	SHYPNM_Stats.since = now;
+	SHYPNM_Stats.phase = phase;
+	return prev;
+}
+
+void SHYPNM_StatMerge(const SHYPNM_StatState *other)
+{
+	// Adds the counters of another thread, but not its time.
+	SHYPNM_Stats.bytes_read += other->bytes_read;
+	SHYPNM_Stats.io_calls += other->io_calls;
+	SHYPNM_Stats.alloc_bytes += other->alloc_bytes;
+	if (other->simd > SHYPNM_Stats.simd) {
+		SHYPNM_Stats.simd = other->simd;
+	}
+	if (other->threads > SHYPNM_Stats.threads) {
+		SHYPNM_Stats.threads = other->threads;
+	}
+}
 
-void SHYPNM_FindToken(FILE *f)
+void PnmGetStats(PnmStats *stats)
 {
-	int c = fgetc(f);
+	// The current phase is brought up to date first.
+	SHYPNM_StatPhase(SHYPNM_Stats.phase);
+	*stats = (PnmStats){.open_ns     = SHYPNM_Stats.ns[SHYPNM_PHASEOPEN],
+	                    .header_ns   = SHYPNM_Stats.ns[SHYPNM_PHASEHEADER],
+	                    .alloc_ns    = SHYPNM_Stats.ns[SHYPNM_PHASEALLOC],
+	                    .table_ns    = SHYPNM_Stats.ns[SHYPNM_PHASETABLE],
+	                    .decode_ns   = SHYPNM_Stats.ns[SHYPNM_PHASEDECODE],
+	                    .bytes_read  = SHYPNM_Stats.bytes_read,
+	                    .io_calls    = SHYPNM_Stats.io_calls,
+	                    .alloc_bytes = SHYPNM_Stats.alloc_bytes,
+	                    .simd        = SHYPNM_Stats.simd,
+	                    .threads     = SHYPNM_Stats.threads};
+}
+
+void PnmResetStats(void)
+{
+	int phase = SHYPNM_Stats.phase;
+
+	memset(&SHYPNM_Stats, 0, sizeof(SHYPNM_Stats));
+	SHYPNM_Stats.since = SHYPNM_Clock();
+	SHYPNM_Stats.phase = phase;
+}
+
+#define SHYPNM_STATENTER(phase)    int shypnm_phase = SHYPNM_StatPhase(phase)
+#define SHYPNM_STATLEAVE()         SHYPNM_StatPhase(shypnm_phase)
+#define SHYPNM_STATADD(counter, n) (SHYPNM_Stats.counter += (n))
+#define SHYPNM_STATMAX(counter, n)                                             \
+	do {                                                                   \
+		if ((n) > SHYPNM_Stats.counter) {                              \
+			SHYPNM_Stats.counter = (n);                            \
+		}                                                              \
+	} while (0)
+
+#else
+
+void PnmGetStats(PnmStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+void PnmResetStats(void)
+{
+}
+
+#define SHYPNM_STATENTER(phase)
+#define SHYPNM_STATLEAVE()
+#define SHYPNM_STATADD(counter, n)
+#define SHYPNM_STATMAX(counter, n)
+
+#endif
+
+// Buffers are taken from the runtime allocator if one is set, and otherwise
+// from SHY_MALLOC and SHY_FREE or the standard library. Tables and images
+// cached between loads and the async pool's queues skip the runtime allocator,
+// since they can outlive it.
+#if defined(SHY_MALLOC) || defined(SHY_REALLOC) || defined(SHY_FREE)
+#if !defined(SHY_MALLOC) || !defined(SHY_REALLOC) || !defined(SHY_FREE)
+#error "SHY_MALLOC, SHY_REALLOC and SHY_FREE must be defined together"
+#endif
+#define SHYPNM_DEFAULTMALLOC(size)       SHY_MALLOC(size)
+#define SHYPNM_DEFAULTREALLOC(ptr, size) SHY_REALLOC(ptr, size)
+#define SHYPNM_DEFAULTFREE(ptr)          SHY_FREE(ptr)
+#else
+#define SHYPNM_DEFAULTMALLOC(size)       malloc(size)
+#define SHYPNM_DEFAULTREALLOC(ptr, size) realloc(ptr, size)
+#define SHYPNM_DEFAULTFREE(ptr)          free(ptr)
+#endif
+
+#define SHYPNM_MALLOC(size)            SHYPNM_Malloc(size)
+#define SHYPNM_CALLOC(n, size)         SHYPNM_Calloc(n, size)
+#define SHYPNM_REALLOC(ptr, old, size) SHYPNM_Realloc(ptr, old, size)
+#define SHYPNM_FREE(ptr)               SHYPNM_Free(ptr)
+
+ShyAllocator SHYPNM_Allocator;
+
+void PnmSetAllocator(const ShyAllocator *allocator)
+{
+	if (allocator && (!allocator->alloc != !allocator->release ||
+	                  (allocator->resize && !allocator->alloc))) {
+		fprintf(stderr, "Error setting allocator; alloc and release "
+		                "must both be set.\n");
+		return;
+	}
+	SHYPNM_Allocator = allocator ? *allocator : (ShyAllocator){0};
+}
+
+void *SHYPNM_Malloc(size_t size)
+{
+	SHYPNM_STATENTER(SHYPNM_PHASEALLOC);
+	SHYPNM_STATADD(alloc_bytes, size);
+
+	void *ptr;
+	if (SHYPNM_Allocator.alloc) {
+		ptr = SHYPNM_Allocator.alloc(SHYPNM_Allocator.ctx, size);
+	} else {
+		ptr = SHYPNM_DEFAULTMALLOC(size);
+	}
+
+	SHYPNM_STATLEAVE();
+	return ptr;
+}
+
+void *SHYPNM_Calloc(size_t n, size_t size)
+{
+	void *ptr = SHYPNM_Malloc(n * size);
+	if (ptr) {
+		memset(ptr, 0, n * size);
+	}
+	return ptr;
+}
+
+void SHYPNM_Free(void *ptr)
+{
+	if (!ptr) {
+		return;
+	} else if (SHYPNM_Allocator.release) {
+		SHYPNM_Allocator.release(SHYPNM_Allocator.ctx, ptr);
+	} else {
+		SHYPNM_DEFAULTFREE(ptr);
+	}
+}
+
+void *SHYPNM_Realloc(void *ptr, size_t old, size_t size)
+{
+	// Runtime allocators without resize are given a new buffer, into which
+	// the old bytes of ptr are copied.
+	SHYPNM_STATENTER(SHYPNM_PHASEALLOC);
+	SHYPNM_STATADD(alloc_bytes, size > old ? size - old : 0);
+
+	void *grown;
+	if (SHYPNM_Allocator.resize) {
+		grown = SHYPNM_Allocator.resize(
+		    SHYPNM_Allocator.ctx, ptr, size);
+	} else if (!SHYPNM_Allocator.alloc) {
+		grown = SHYPNM_DEFAULTREALLOC(ptr, size);
+	} else {
+		grown = SHYPNM_Allocator.alloc(SHYPNM_Allocator.ctx, size);
+		if (grown && ptr) {
+			memcpy(grown, ptr, old < size ? old : size);
+			SHYPNM_Free(ptr);
+		}
+	}
+
+	SHYPNM_STATLEAVE();
+	return grown;
+}
+
+void PnmFree(void *pix)
+{
+	SHYPNM_Free(pix);
+}
+
+// All parsing functions read through a source, which is either an open file
+// or a range of bytes already in memory (such as a memory-mapped file). The
+// memory case avoids the stdio call and locking overhead of fgetc() for every
+// byte of the image.
+typedef struct {
+	FILE *         f;
+	const uint8_t *data;
+	size_t         size;
+	size_t         pos;
+} SHYPNM_Source;
+
+SHYPNM_Source SHYPNM_FileSource(FILE *f)
+{
+	return (SHYPNM_Source){.f = f};
+}
+
+SHYPNM_Source SHYPNM_MemorySource(const void *data, size_t size)
+{
+	return (SHYPNM_Source){.data = data, .size = size};
+}
+
+int SHYPNM_Getc(SHYPNM_Source *src)
+{
+	if (src->f) {
+		int c = fgetc(src->f);
+		SHYPNM_STATADD(bytes_read, c >= 0);
+		return c;
+	} else if (src->pos < src->size) {
+		return src->data[src->pos++];
+	} else {
+		return -1;
+	}
+}
+
+bool SHYPNM_Eof(SHYPNM_Source *src)
+{
+	if (src->f) {
+		return feof(src->f);
+	} else {
+		return src->pos >= src->size;
+	}
+}
+
+size_t SHYPNM_Tell(SHYPNM_Source *src)
+{
+	if (src->f) {
+		return ftell(src->f);
+	} else {
+		return src->pos;
+	}
+}
+
+void SHYPNM_Seek(SHYPNM_Source *src, size_t pos)
+{
+	if (src->f) {
+		// Bytes stepped back over are read again, but counted once.
+		SHYPNM_STATADD(bytes_read, (int64_t)pos - ftell(src->f));
+		fseek(src->f, pos, SEEK_SET);
+	} else {
+		src->pos = pos;
+	}
+}
+
+const uint8_t *SHYPNM_Read(SHYPNM_Source *src, uint8_t *buf, size_t n)
+{
+	// Returns a pointer to the next n bytes of the source, or NULL if fewer
+	// than n bytes remain. File sources read into buf, memory sources
+	// return a pointer into their own data without copying.
+	if (src->f) {
+		size_t got = fread(buf, 1, n, src->f);
+		SHYPNM_STATADD(bytes_read, got);
+		SHYPNM_STATADD(io_calls, 1);
+		return got == n ? buf : NULL;
+	} else if (src->size - src->pos >= n) {
+		src->pos += n;
+		return src->data + src->pos - n;
+	} else {
+		src->pos = src->size;
+		return NULL;
+	}
+}
+
+FILE *SHYPNM_OpenFile(const char *filename)
+{
+	SHYPNM_STATENTER(SHYPNM_PHASEOPEN);
+	SHYPNM_STATADD(io_calls, 1);
+
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
+		fprintf(stderr, "Error opening file '%s'.\n", filename);
+	}
+
+	SHYPNM_STATLEAVE();
+	return f;
+}
+
+void SHYPNM_SkipComment(SHYPNM_Source *src)
+{
+	// Skips the rest of a comment, up to and including the newline. The
+	// end of the source also ends a comment, so truncated data is left to
+	// fail at the next read instead of being waited on forever.
+	int c;
+	do {
+		c = SHYPNM_Getc(src);
+	} while (c != '\n' && c >= 0);
+}
+
+void SHYPNM_FindToken(SHYPNM_Source *src)
+{
+	int c = SHYPNM_Getc(src);
 
 	while (c != -1) {
 		if (c == '#') {
-			while (!feof(f) && fgetc(f) != '\n')
-				;
+			SHYPNM_SkipComment(src);
 		} else if (!isspace(c)) {
-			fseek(f, -1, SEEK_CUR);
+			SHYPNM_Seek(src, SHYPNM_Tell(src) - 1);
 			return;
 		}
-		c = fgetc(f);
+		c = SHYPNM_Getc(src);
 	}
 }
 
-bool SHYPNM_TokenTerminator(FILE *f)
+bool SHYPNM_TokenTerminator(SHYPNM_Source *src)
 {
-	int c = fgetc(f);
+	int c = SHYPNM_Getc(src);
 	if (c == '#') {
-		while (!feof(f) && fgetc(f) != '\n')
-			;
+		SHYPNM_SkipComment(src);
 		return true;
 	} else {
 		return (c == -1 || isspace(c));
 	}
 }
 
-void SHYPNM_SkipToken(FILE *f)
+void SHYPNM_SkipToken(SHYPNM_Source *src)
 {
-	while (!SHYPNM_TokenTerminator(f))
+	while (!SHYPNM_TokenTerminator(src))
 		;
 }
 
-bool SHYPNM_TokenMatch(FILE *f, const char *str)
+bool SHYPNM_TokenMatch(SHYPNM_Source *src, const char *str)
 {
 	// Returns true if the current token in the file matches the given
 	// string. If the tokens match, the token will be consumed by the file
 	// pointer, but if the tokens do not match, the file pointer will be
 	// returned to the beginning of the token.
 
-	size_t bookmark = ftell(f);
+	size_t bookmark = SHYPNM_Tell(src);
 
 	for (int i = 0; str[i]; i++) {
-		if (feof(f) || fgetc(f) != str[i]) {
-			fseek(f, bookmark, SEEK_SET);
+		if (SHYPNM_Eof(src) || SHYPNM_Getc(src) != str[i]) {
+			SHYPNM_Seek(src, bookmark);
 			return false;
 		}
 	}
-	if (SHYPNM_TokenTerminator(f)) {
+	if (SHYPNM_TokenTerminator(src)) {
 		return true;
 	} else {
-		fseek(f, bookmark, SEEK_SET);
+		SHYPNM_Seek(src, bookmark);
 		return false;
 	}
 }
 
-int SHYPNM_GrabInt(FILE *f)
+int SHYPNM_GrabInt(SHYPNM_Source *src)
 {
-	SHYPNM_FindToken(f);
+	SHYPNM_FindToken(src);
 
-	if (feof(f)) {
+	if (SHYPNM_Eof(src)) {
 		fprintf(stderr,
 		        "Error reading pnm file; unexpected end-of-file "
 		        "reached while reading integer.\n");
@@ -111,7 +936,8 @@ int SHYPNM_GrabInt(FILE *f)
 	int c;
 	int n = 0;
 
-	for (c = fgetc(f); c != -1 && !isspace(c) && c != '#'; c = fgetc(f)) {
+	for (c = SHYPNM_Getc(src); c != -1 && !isspace(c) && c != '#';
+	     c = SHYPNM_Getc(src)) {
 		if (c >= '0' && c <= '9') {
 			n = (n * 10) + (c - '0');
 		} else {
@@ -123,53 +949,97 @@ int SHYPNM_GrabInt(FILE *f)
 	}
 
 	if (c == '#') {
-		while (fgetc(f) != '\n')
-			;
+		SHYPNM_SkipComment(src);
 	}
 
 	return n;
 }
 
-uint32_t *SHYPNM_ReadPamHeader(FILE *f, int *w, int *h, int *depth, int *maxval)
+#define SHYPNM_TUPLTYPEMAX 32
+
+void SHYPNM_ReadTupleType(SHYPNM_Source *src, char *dest)
+{
+	// The tuple type is the rest of the TUPLTYPE line, and the values of
+	// several TUPLTYPE lines are joined with spaces. Tuple types too long
+	// for dest are truncated. Nothing remains of the line if the keyword
+	// was followed by a newline or a comment.
+	SHYPNM_Seek(src, SHYPNM_Tell(src) - 1);
+	int c = SHYPNM_Getc(src);
+	if (c == '\n' || !isspace(c)) {
+		return;
+	}
+
+	while (c == ' ' || c == '\t') {
+		c = SHYPNM_Getc(src);
+	}
+
+	size_t len = strlen(dest);
+	if (len > 0 && c != '\n' && c != -1 && len + 1 < SHYPNM_TUPLTYPEMAX) {
+		dest[len++] = ' ';
+	}
+	for (; c != '\n' && c != -1; c = SHYPNM_Getc(src)) {
+		if (len + 1 < SHYPNM_TUPLTYPEMAX) {
+			dest[len++] = c;
+		}
+	}
+	while (len > 0 && isspace((unsigned char)dest[len - 1])) {
+		len--;
+	}
+	dest[len] = '\0';
+}
+
+bool SHYPNM_ReadPamHeader(SHYPNM_Source *src,
+                          int *          w,
+                          int *          h,
+                          int *          depth,
+                          int *          maxval,
+                          char *         tupltype)
 {
 	for (bool header = true; header;) {
-		SHYPNM_FindToken(f);
-		if (SHYPNM_TokenMatch(f, "DEPTH")) {
-			*depth = SHYPNM_GrabInt(f);
+		SHYPNM_FindToken(src);
+		if (SHYPNM_Eof(src)) {
+			fprintf(stderr,
+			        "Error reading Pnm file; unexpected "
+			        "end-of-file reached before ENDHDR.\n");
+			*w = -1;
+			*h = -1;
+			return false;
+		} else if (SHYPNM_TokenMatch(src, "DEPTH")) {
+			*depth = SHYPNM_GrabInt(src);
 			if (*depth < 0) {
 				*w = -1;
 				*h = -1;
-				return NULL;
+				return false;
 			}
-		} else if (SHYPNM_TokenMatch(f, "MAXVAL")) {
-			*maxval = SHYPNM_GrabInt(f);
+		} else if (SHYPNM_TokenMatch(src, "MAXVAL")) {
+			*maxval = SHYPNM_GrabInt(src);
 			if (*maxval < 0) {
 				*w = -1;
 				*h = -1;
-				return NULL;
+				return false;
 			}
-		} else if (SHYPNM_TokenMatch(f, "HEIGHT")) {
-			*h = SHYPNM_GrabInt(f);
+		} else if (SHYPNM_TokenMatch(src, "HEIGHT")) {
+			*h = SHYPNM_GrabInt(src);
 			if (*h < 0) {
 				*w = -1;
-				return NULL;
+				return false;
 			}
-		} else if (SHYPNM_TokenMatch(f, "WIDTH")) {
-			*w = SHYPNM_GrabInt(f);
+		} else if (SHYPNM_TokenMatch(src, "WIDTH")) {
+			*w = SHYPNM_GrabInt(src);
 			if (*w < 0) {
 				*h = -1;
-				return NULL;
+				return false;
 			}
-		} else if (SHYPNM_TokenMatch(f, "ENDHDR")) {
+		} else if (SHYPNM_TokenMatch(src, "TUPLTYPE")) {
+			SHYPNM_ReadTupleType(src, tupltype);
+		} else if (SHYPNM_TokenMatch(src, "ENDHDR")) {
 			header = false;
 		} else {
 			// Unknown tokens will be skipped, along with their
-			// corresponding value token. Currently, TUPLTYPE tokens
-			// default to this, as the tuple type value is
-			// unnecessary for loading image files.
-			SHYPNM_SkipToken(f);
-			SHYPNM_FindToken(f);
-			SHYPNM_SkipToken(f);
+			// corresponding value token.
+			SHYPNM_SkipToken(src);
+			SHYPNM_FindToken(src);
+			SHYPNM_SkipToken(src);
 		}
 	}
 
@@ -178,7 +1048,7 @@ uint32_t *SHYPNM_ReadPamHeader(FILE *f, int *w, int *h, int *depth, int *maxval)
 		        "Error reading Pnm file; depth must be between 1-4.\n");
 		*w = -1;
 		*h = -1;
-		return NULL;
+		return false;
 	}
 	if (*maxval < 1 || *maxval > UINT16_MAX) {
 		fprintf(
@@ -187,35 +1057,27 @@ uint32_t *SHYPNM_ReadPamHeader(FILE *f, int *w, int *h, int *depth, int *maxval)
 		    UINT16_MAX);
 		*w = -1;
 		*h = -1;
-		return NULL;
+		return false;
 	}
 	if (*w < 1) {
 		fprintf(stderr,
 		        "Error reading Pnm file; width must be at least 1.\n");
 		*h = -1;
-		return NULL;
+		return false;
 	}
 	if (*h < 1) {
 		fprintf(stderr,
 		        "Error reading Pnm file; height must be at least 1.\n");
 		*w = -1;
-		return NULL;
-	}
-
-	uint32_t *pix = malloc((*w) * (*h) * sizeof(uint32_t));
-	if (!pix) {
-		perror(strerror(errno));
-		*w = -1;
-		*h = -1;
-		return NULL;
+		return false;
 	}
 
-	return pix;
+	return true;
 }
 
-uint32_t *SHYPNM_ReadHeader(FILE *f, int *w, int *h, int *maxval)
+bool SHYPNM_ReadHeader(SHYPNM_Source *src, int *w, int *h, int *maxval)
 {
-	*w = SHYPNM_GrabInt(f);
+	*w = SHYPNM_GrabInt(src);
 	if (*w < 1) {
 		if (*w == 0) {
 			fprintf(stderr,
@@ -224,10 +1086,10 @@ uint32_t *SHYPNM_ReadHeader(FILE *f, int *w, int *h, int *maxval)
 		}
 		*w = -1;
 		*h = -1;
-		return NULL;
+		return false;
 	}
 
-	*h = SHYPNM_GrabInt(f);
+	*h = SHYPNM_GrabInt(src);
 	if (*h < 1) {
 		if (*h == 0) {
 			fprintf(stderr,
@@ -236,10 +1098,10 @@ uint32_t *SHYPNM_ReadHeader(FILE *f, int *w, int *h, int *maxval)
 		}
 		*w = -1;
 		*h = -1;
-		return NULL;
+		return false;
 	}
 
-	*maxval = SHYPNM_GrabInt(f);
+	*maxval = SHYPNM_GrabInt(src);
 	if (*maxval < 1 || *maxval > UINT16_MAX) {
 		if (*maxval > 0) {
 			fprintf(stderr,
@@ -249,23 +1111,15 @@ uint32_t *SHYPNM_ReadHeader(FILE *f, int *w, int *h, int *maxval)
 		}
 		*w = -1;
 		*h = -1;
-		return NULL;
-	}
-
-	uint32_t *pix = malloc((*w) * (*h) * sizeof(uint32_t));
-	if (!pix) {
-		perror(strerror(errno));
-		*w = -1;
-		*h = -1;
-		return NULL;
+		return false;
 	}
 
-	return pix;
+	return true;
 }
 
-uint32_t *SHYPNM_ReadPbmHeader(FILE *f, int *w, int *h)
+bool SHYPNM_ReadPbmHeader(SHYPNM_Source *src, int *w, int *h)
 {
-	*w = SHYPNM_GrabInt(f);
+	*w = SHYPNM_GrabInt(src);
 	if (*w < 1) {
 		if (*w == 0) {
 			fprintf(stderr,
@@ -274,10 +1128,10 @@ uint32_t *SHYPNM_ReadPbmHeader(FILE *f, int *w, int *h)
 		}
 		*w = -1;
 		*h = -1;
-		return NULL;
+		return false;
 	}
 
-	*h = SHYPNM_GrabInt(f);
+	*h = SHYPNM_GrabInt(src);
 	if (*h < 1) {
 		if (*h == 0) {
 			fprintf(stderr,
@@ -286,396 +1140,5177 @@ uint32_t *SHYPNM_ReadPbmHeader(FILE *f, int *w, int *h)
 		}
 		*w = -1;
 		*h = -1;
-		return NULL;
+		return false;
+	}
+
+	return true;
+}
+
+// The image described by a header. PBM, PGM and PPM images are given the
+// depth, maxval and tuple type of the equivalent PAM images.
+typedef struct {
+	int  magic;
+	int  w;
+	int  h;
+	int  depth;
+	int  maxval;
+	char tupltype[SHYPNM_TUPLTYPEMAX];
+} SHYPNM_Header;
+
+bool SHYPNM_ParseHeader(SHYPNM_Source *src,
+                        const char *   name,
+                        SHYPNM_Header *hdr)
+{
+	// Reads the magic number and the header that follows it, leaving the
+	// source at the first byte of the raster.
+	SHYPNM_STATENTER(SHYPNM_PHASEHEADER);
+	SHYPNM_STATMAX(threads, 1);
+	*hdr = (SHYPNM_Header){.depth = 1, .maxval = 1};
+
+	bool ok = false;
+	if (SHYPNM_Getc(src) == 'P') {
+		hdr->magic = SHYPNM_Getc(src);
+	}
+
+	switch (hdr->magic) {
+	case '1':
+	case '4':
+		strcpy(hdr->tupltype, "BLACKANDWHITE");
+		ok = SHYPNM_ReadPbmHeader(src, &hdr->w, &hdr->h);
+		break;
+	case '2':
+	case '5':
+		strcpy(hdr->tupltype, "GRAYSCALE");
+		ok = SHYPNM_ReadHeader(src, &hdr->w, &hdr->h, &hdr->maxval);
+		break;
+	case '3':
+	case '6':
+		strcpy(hdr->tupltype, "RGB");
+		hdr->depth = 3;
+		ok = SHYPNM_ReadHeader(src, &hdr->w, &hdr->h, &hdr->maxval);
+		break;
+	case '7':
+		hdr->depth  = 0;
+		hdr->maxval = 0;
+
+		ok = SHYPNM_ReadPamHeader(src,
+		                          &hdr->w,
+		                          &hdr->h,
+		                          &hdr->depth,
+		                          &hdr->maxval,
+		                          hdr->tupltype);
+		break;
+	default:
+		fprintf(stderr,
+		        "File '%s' is not a valid pnm file. Invalid magic "
+		        "number encountered.\n",
+		        name);
+		break;
 	}
 
-	uint32_t *pix = malloc((*w) * (*h) * sizeof(uint32_t));
+	if (!ok) {
+		hdr->w = -1;
+		hdr->h = -1;
+	}
+	SHYPNM_STATLEAVE();
+	return ok;
+}
+
+uint32_t *SHYPNM_AllocPixels(int w, int h)
+{
+	uint32_t *pix = SHYPNM_MALLOC((size_t)w * h * sizeof(uint32_t));
 	if (!pix) {
 		perror(strerror(errno));
-		*w = -1;
-		*h = -1;
-		return NULL;
 	}
 
 	return pix;
 }
 
-bool SHYPNM_GrabAsciiValue(FILE *f, int maxval, uint32_t *dest)
+// Samples are rescaled from 0-maxval to 0-255 as (n * 255) / maxval. Since
+// n * 255 is always below 2^24, the division can be replaced by a multiply
+// with a rounded-up reciprocal of maxval and a shift of 24 + ceil(log2(maxval))
+// bits, which gives exactly the same result for every valid sample.
+typedef struct {
+	uint32_t        maxval;
+	uint32_t        mul;
+	int             shift;
+	const uint16_t *table;
+} SHYPNM_Scale;
+
+SHYPNM_Scale SHYPNM_MakeScale(int maxval)
+{
+	SHYPNM_Scale scale = {.maxval = maxval, .shift = 24};
+	while ((1u << (scale.shift - 24)) < scale.maxval) {
+		scale.shift++;
+	}
+	scale.mul = ((1ull << scale.shift) + maxval - 1) / maxval;
+
+	return scale;
+}
+
+uint32_t SHYPNM_ScaleValue(const SHYPNM_Scale *scale, uint32_t n)
+{
+	return ((uint64_t)n * 255 * scale->mul) >> scale->shift;
+}
+
+// Scalar code rescales through a lookup table covering every possible sample
+// value for the file's maxval, with entries above maxval marked as invalid so
+// the lookup doubles as the range check. Tables are kept in a small cache, so
+// loading many files with the same maxval only builds the table once. Tables
+// are reference counted while in use, and if every cache slot is busy a
+// private table is built instead.
+#define SHYPNM_LUTINVALID 0x100
+#define SHYPNM_LUTCACHESIZE 8
+
+typedef struct {
+	int       maxval;
+	int       refs;
+	bool      cached;
+	uint64_t  stamp;
+	uint16_t *table;
+} SHYPNM_Lut;
+
+SHYPNM_Lut SHYPNM_LutCache[SHYPNM_LUTCACHESIZE];
+uint64_t   SHYPNM_LutClock;
+
+#ifdef SHYPNM_HAVE_PTHREADS
+pthread_mutex_t SHYPNM_LutMutex = PTHREAD_MUTEX_INITIALIZER;
+#define SHYPNM_LUTLOCK() pthread_mutex_lock(&SHYPNM_LutMutex)
+#define SHYPNM_LUTUNLOCK() pthread_mutex_unlock(&SHYPNM_LutMutex)
+#else
+#define SHYPNM_LUTLOCK()
+#define SHYPNM_LUTUNLOCK()
+#endif
+
+uint16_t *SHYPNM_BuildLut(int maxval)
+{
+	size_t    size  = maxval > UINT8_MAX ? UINT16_MAX + 1 : UINT8_MAX + 1;
+	uint16_t *table = SHYPNM_DEFAULTMALLOC(size * sizeof(uint16_t));
+	if (!table) {
+		perror(strerror(errno));
+		return NULL;
+	}
+
+	SHYPNM_STATENTER(SHYPNM_PHASETABLE);
+
+	SHYPNM_Scale scale = SHYPNM_MakeScale(maxval);
+	for (size_t n = 0; n < size; n++) {
+		if (n <= (size_t)maxval) {
+			table[n] = SHYPNM_ScaleValue(&scale, n);
+		} else {
+			table[n] = SHYPNM_LUTINVALID;
+		}
+	}
+	SHYPNM_STATLEAVE();
+
+	return table;
+}
+
+SHYPNM_Lut *SHYPNM_AcquireLut(int maxval)
+{
+	SHYPNM_Lut *lut    = NULL;
+	SHYPNM_Lut *victim = NULL;
+
+	SHYPNM_LUTLOCK();
+	for (int i = 0; i < SHYPNM_LUTCACHESIZE; i++) {
+		SHYPNM_Lut *entry = &SHYPNM_LutCache[i];
+		if (entry->table && entry->maxval == maxval) {
+			lut = entry;
+			break;
+		} else if (!entry->refs
+		           && (!victim || entry->stamp < victim->stamp)) {
+			victim = entry;
+		}
+	}
+	if (!lut && victim) {
+		uint16_t *table = SHYPNM_BuildLut(maxval);
+		if (!table) {
+			SHYPNM_LUTUNLOCK();
+			return NULL;
+		}
+		SHYPNM_DEFAULTFREE(victim->table);
+		victim->table  = table;
+		victim->maxval = maxval;
+		victim->cached = true;
+		lut            = victim;
+	}
+	if (lut) {
+		lut->refs++;
+		lut->stamp = ++SHYPNM_LutClock;
+	}
+	SHYPNM_LUTUNLOCK();
+
+	if (lut) {
+		return lut;
+	}
+
+	lut = SHYPNM_DEFAULTMALLOC(sizeof(SHYPNM_Lut));
+	if (!lut) {
+		perror(strerror(errno));
+		return NULL;
+	}
+	*lut       = (SHYPNM_Lut){.maxval = maxval};
+	lut->table = SHYPNM_BuildLut(maxval);
+	if (!lut->table) {
+		SHYPNM_DEFAULTFREE(lut);
+		return NULL;
+	}
+
+	return lut;
+}
+
+void SHYPNM_ReleaseLut(SHYPNM_Lut *lut)
+{
+	if (!lut) {
+		return;
+	} else if (!lut->cached) {
+		SHYPNM_DEFAULTFREE(lut->table);
+		SHYPNM_DEFAULTFREE(lut);
+		return;
+	}
+
+	SHYPNM_LUTLOCK();
+	lut->refs--;
+	SHYPNM_LUTUNLOCK();
+}
+
+bool SHYPNM_GrabAsciiValue(SHYPNM_Source *   src,
+                           const SHYPNM_Lut *lut,
+                           uint32_t *        dest)
 {
-	int n = SHYPNM_GrabInt(f);
+	int n = SHYPNM_GrabInt(src);
 	if (n < 0) {
 		return false;
-	} else if (n > maxval) {
+	} else if (n > lut->maxval) {
 		fprintf(stderr,
 		        "Error reading Pnm file; pixel value greater than "
 		        "maxval encountered.\n");
 		return false;
 	}
 
-	*dest = ((uint32_t)n * 255) / maxval;
+	*dest = lut->table[n];
 	return true;
 }
 
-bool SHYPNM_GrabBinValue(FILE *f, int maxval, uint32_t *dest)
+// Plain samples held in memory are tokenized without going through a source
+// one character at a time. SHYPNM_ScanValue() parses a single sample, while
+// the AVX2 kernel classifies 32 bytes at a time into whitespace and digit
+// masks, which give both the start and the length of the next token, and
+// converts runs of up to eight digits with SWAR multiply-adds. Whenever the
+// kernel meets anything unusual (comments, long tokens, invalid characters or
+// the end of the data) it hands over to the scalar code for one sample.
+bool SHYPNM_ScanValue(const uint8_t **   pp,
+                      const uint8_t *    end,
+                      const SHYPNM_Lut * lut,
+                      uint8_t *          dest)
 {
-	if (feof(f)) {
+	const uint8_t *p = *pp;
+
+	while (p < end && (isspace(*p) || *p == '#')) {
+		if (*p == '#') {
+			p = memchr(p, '\n', end - p);
+			p = p ? p : end;
+		} else {
+			p++;
+		}
+	}
+	if (p == end) {
 		fprintf(stderr,
-		        "Error reading Pnm file; unexpected end-of-file "
-		        "reached while reading pixel data.\n");
+		        "Error reading pnm file; unexpected end-of-file "
+		        "reached while reading integer.\n");
 		return false;
 	}
-	*dest = fgetc(f);
-	if (maxval > UINT8_MAX) {
-		if (feof(f)) {
-			fprintf(
-			    stderr,
-			    "Error reading Pnm file; unexpected end-of-file "
-			    "reached while reading pixel data.\n");
+
+	uint32_t v = 0;
+	for (; p < end && !isspace(*p) && *p != '#'; p++) {
+		if (*p < '0' || *p > '9') {
+			fprintf(stderr,
+			        "Error reading Pnm file; invalid character "
+			        "encountered in integer.\n");
 			return false;
+		} else if (v <= UINT16_MAX) {
+			v = (v * 10) + (*p - '0');
 		}
-		*dest = (*dest << 8) | fgetc(f);
 	}
-
-	if (*dest > (uint32_t)maxval) {
+	if (v > (uint32_t)lut->maxval) {
 		fprintf(stderr,
 		        "Error reading Pnm file; pixel value greater than "
 		        "maxval encountered.\n");
 		return false;
 	}
 
-	*dest = (*dest * 255) / (uint32_t)maxval;
+	*dest = lut->table[v];
+	*pp   = p;
 	return true;
 }
 
-bool SHYPNM_GrayscaleLoad(FILE *    f,
-                          uint32_t *pix,
-                          int       w,
-                          int       h,
-                          int       maxval,
-                          bool      get_alpha)
+#ifdef SHYPNM_HAVE_X86_SIMD
+
+uint32_t SHYPNM_ParseDigits(const uint8_t *p, int len)
+{
+	// Converts 1-8 ASCII digits, with at least 8 bytes readable at p. The
+	// digits are shifted to the top of the word so the unused bytes become
+	// leading zeros, then pairs, quads and octets of digits are combined
+	// with one multiply each.
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	v <<= 8 * (8 - len);
+	v = ((v & 0x0f0f0f0f0f0f0f0f) * 2561) >> 8;
+	v = ((v & 0x00ff00ff00ff00ff) * 6553601) >> 16;
+	return ((v & 0x0000ffff0000ffff) * 42949672960001) >> 32;
+}
+
+__attribute__((target("avx2"))) uint32_t SHYPNM_ClassifyAvx2(const uint8_t *p,
+                                                             uint32_t *space)
 {
-	int      size = w * h;
-	uint32_t gray, alpha;
+	// Returns the mask of digits in the 32 bytes at p, and stores the mask
+	// of whitespace (space, or \t through \r) in space.
+	const __m256i c  = _mm256_loadu_si256((const __m256i *)p);
+	const __m256i ws = _mm256_sub_epi8(c, _mm256_set1_epi8('\t'));
+	const __m256i d  = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
 
-	if (get_alpha) {
-		for (int i = 0; i < size; i++) {
-			if (!SHYPNM_GrabBinValue(f, maxval, &gray)
-			    || !SHYPNM_GrabBinValue(f, maxval, &alpha)) {
-				return false;
-			}
-			pix[i]
-			    = (gray << 24) | (gray << 16) | (gray << 8) | alpha;
+	__m256i is_ws = _mm256_or_si256(
+	    _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+	    _mm256_cmpeq_epi8(_mm256_min_epu8(ws, _mm256_set1_epi8(4)), ws));
+	__m256i is_d
+	    = _mm256_cmpeq_epi8(_mm256_min_epu8(d, _mm256_set1_epi8(9)), d);
+
+	*space = _mm256_movemask_epi8(is_ws);
+	return _mm256_movemask_epi8(is_d);
+}
+
+__attribute__((target("avx2"))) size_t
+SHYPNM_ScanSamplesAvx2(const uint8_t **   pp,
+                       const uint8_t *    end,
+                       const SHYPNM_Lut * lut,
+                       uint8_t *          dest,
+                       size_t             n)
+{
+	const uint8_t *p = *pp;
+	size_t         i = 0;
+
+	while (i < n && end - p >= 32) {
+		uint32_t space;
+		uint32_t digit = SHYPNM_ClassifyAvx2(p, &space);
+		if (space == UINT32_MAX) {
+			p += 32;
+			continue;
 		}
-	} else {
-		for (int i = 0; i < size; i++) {
-			if (!SHYPNM_GrabBinValue(f, maxval, &gray)) {
-				return false;
-			}
-			pix[i]
-			    = (gray << 24) | (gray << 16) | (gray << 8) | 0xff;
+
+		int start = __builtin_ctz(~space);
+		int len   = __builtin_ctz(~(digit >> start) | (1u << 31));
+		if (start + len >= 32 && start > 0) {
+			// The token may continue past this block, so reclassify
+			// starting from the token itself.
+			p += start;
+			continue;
+		}
+
+		// The token must be a run of 1-8 digits ending in whitespace
+		// or a comment, and be readable as a whole word.
+		int next = start + len;
+		if (len == 0 || len > 8 || next >= 32 || end - (p + start) < 8
+		    || (!((space >> next) & 1) && p[next] != '#')) {
+			p += start;
+			break;
+		}
+
+		uint32_t v = SHYPNM_ParseDigits(p + start, len);
+		if (v > (uint32_t)lut->maxval) {
+			p += start;
+			break;
 		}
+		dest[i++] = lut->table[v];
+		p += next;
 	}
 
-	return true;
+	*pp = p;
+	return i;
 }
 
-bool SHYPNM_ColorLoad(FILE *    f,
-                      uint32_t *pix,
-                      int       w,
-                      int       h,
-                      int       maxval,
-                      bool      get_alpha)
+#endif
+
+bool SHYPNM_ScanSamples(const uint8_t **   pp,
+                        const uint8_t *    end,
+                        const SHYPNM_Lut * lut,
+                        uint8_t *          dest,
+                        size_t             n)
 {
-	int      size = w * h;
-	uint32_t r, g, b, a;
+	// Parses n plain samples starting at *pp into rescaled 8-bit values,
+	// and advances *pp past the last of them.
+#ifdef SHYPNM_HAVE_X86_SIMD
+	bool avx2 = SHYPNM_SimdLevel() == SHYPNM_SIMDAVX2;
+#endif
 
-	if (get_alpha) {
-		for (int i = 0; i < size; i++) {
-			if (!SHYPNM_GrabBinValue(f, maxval, &r)
-			    || !SHYPNM_GrabBinValue(f, maxval, &g)
-			    || !SHYPNM_GrabBinValue(f, maxval, &b)
-			    || !SHYPNM_GrabBinValue(f, maxval, &a)) {
-				return false;
+	for (size_t i = 0; i < n; i++) {
+#ifdef SHYPNM_HAVE_X86_SIMD
+		if (avx2) {
+			i += SHYPNM_ScanSamplesAvx2(
+			    pp, end, lut, dest + i, n - i);
+			SHYPNM_STATMAX(simd, SHYPNM_SIMDAVX2);
+			if (i == n) {
+				break;
 			}
-			pix[i] = (r << 24) | (g << 16) | (b << 8) | a;
 		}
-	} else {
-		for (int i = 0; i < size; i++) {
-			if (!SHYPNM_GrabBinValue(f, maxval, &r)
-			    || !SHYPNM_GrabBinValue(f, maxval, &g)
-			    || !SHYPNM_GrabBinValue(f, maxval, &b)) {
-				return false;
-			}
-			pix[i] = (r << 24) | (g << 16) | (b << 8) | 0xff;
+#endif
+		if (!SHYPNM_ScanValue(pp, end, lut, dest + i)) {
+			return false;
 		}
 	}
 
 	return true;
 }
 
-uint32_t *SHYPNM_PamLoad(FILE *f, int *w, int *h)
+#ifdef SHYPNM_HAVE_X86_SIMD
+__attribute__((target("avx2"))) size_t SHYPNM_CountTokensAvx2(
+    const uint8_t **pp, const uint8_t *end, bool bitmap, bool *in_token)
 {
-	int       depth, maxval;
-	uint32_t *pix = SHYPNM_ReadPamHeader(f, w, h, &depth, &maxval);
-	if (!pix) {
-		return NULL;
-	}
+	// Counts the plain samples in whole 32-byte blocks starting at *pp,
+	// stopping at the first block holding a comment. For P1 every 0 or 1
+	// is a sample; otherwise a sample starts at each non-whitespace byte
+	// that follows whitespace. *in_token carries that state across calls.
+	const uint8_t *p     = *pp;
+	uint32_t       carry = *in_token;
+	size_t         count = 0;
 
-	switch (depth) {
-	case 1:
-		if (!SHYPNM_GrayscaleLoad(f, pix, *w, *h, maxval, false)) {
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
-		}
-		break;
-	case 2:
-		if (!SHYPNM_GrayscaleLoad(f, pix, *w, *h, maxval, true)) {
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
-		}
-		break;
-	case 3:
-		if (!SHYPNM_ColorLoad(f, pix, *w, *h, maxval, false)) {
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
+	for (; end - p >= 32; p += 32) {
+		const __m256i c = _mm256_loadu_si256((const __m256i *)p);
+		uint32_t      space;
+		uint32_t      digit = SHYPNM_ClassifyAvx2(p, &space);
+
+		if (_mm256_movemask_epi8(
+		        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('#')))) {
+			break;
 		}
-		break;
-	case 4:
-		if (!SHYPNM_ColorLoad(f, pix, *w, *h, maxval, true)) {
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
+
+		if (bitmap) {
+			count += __builtin_popcount(
+			    digit
+			    & _mm256_movemask_epi8(_mm256_cmpgt_epi8(
+			        _mm256_set1_epi8('2'), c)));
+		} else {
+			uint32_t solid = ~space;
+			uint32_t first = solid & ~(solid << 1 | carry);
+			count += __builtin_popcount(first);
+			carry = solid >> 31;
 		}
-		break;
-	default:
-		break;
 	}
 
-	return pix;
+	*pp       = p;
+	*in_token = carry;
+	return count;
 }
+#endif
+
+#ifdef SHYPNM_HAVE_X86_SIMD
 
-uint32_t *SHYPNM_PpmRawLoad(FILE *f, int *w, int *h)
+// The SIMD kernels below convert as many whole vectors as they can without
+// reading past the end of the row, and return the number of pixels converted.
+// The remainder of the row is left for the scalar code. On x86 the packed
+// (r << 24) | (g << 16) | (b << 8) | a word is stored as the bytes a, b, g, r.
+
+__attribute__((target("ssse3"))) int
+SHYPNM_ColorRow8Ssse3(const uint8_t *row, uint32_t *pix, int w, bool get_alpha)
 {
-	int       maxval;
-	uint32_t *pix = SHYPNM_ReadHeader(f, w, h, &maxval);
-	if (!pix) {
-		return NULL;
-	}
+	int x = 0;
 
-	if (!SHYPNM_ColorLoad(f, pix, *w, *h, maxval, false)) {
-		*w = -1;
-		*h = -1;
-		free(pix);
-		return NULL;
+	if (get_alpha) {
+		const __m128i shuf = _mm_setr_epi8(
+		    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+		for (; x + 4 <= w; x += 4) {
+			__m128i v
+			    = _mm_loadu_si128((const __m128i *)(row + x * 4));
+			_mm_storeu_si128((__m128i *)(pix + x),
+			                 _mm_shuffle_epi8(v, shuf));
+		}
+	} else {
+		const __m128i shuf = _mm_setr_epi8(
+		    -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+		const __m128i alpha = _mm_set1_epi32(0xff);
+		for (; x + 6 <= w; x += 4) {
+			__m128i v
+			    = _mm_loadu_si128((const __m128i *)(row + x * 3));
+			v = _mm_or_si128(_mm_shuffle_epi8(v, shuf), alpha);
+			_mm_storeu_si128((__m128i *)(pix + x), v);
+		}
 	}
 
-	return pix;
+	return x;
 }
 
-uint32_t *SHYPNM_PgmRawLoad(FILE *f, int *w, int *h)
+__attribute__((target("avx2"))) int
+SHYPNM_ColorRow8Avx2(const uint8_t *row, uint32_t *pix, int w, bool get_alpha)
 {
-	int       maxval;
-	uint32_t *pix = SHYPNM_ReadHeader(f, w, h, &maxval);
-	if (!pix) {
-		return NULL;
-	}
+	int x = 0;
 
-	if (!SHYPNM_GrayscaleLoad(f, pix, *w, *h, maxval, false)) {
-		*w = -1;
-		*h = -1;
-		free(pix);
-		return NULL;
+	if (get_alpha) {
+		const __m256i shuf = _mm256_setr_epi8(
+		    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+		for (; x + 8 <= w; x += 8) {
+			__m256i v = _mm256_loadu_si256(
+			    (const __m256i *)(row + x * 4));
+			_mm256_storeu_si256((__m256i *)(pix + x),
+			                    _mm256_shuffle_epi8(v, shuf));
+		}
+	} else {
+		// Each 128-bit lane is shuffled independently, so the second
+		// group of four RGB triples is first moved into the upper lane.
+		const __m256i spread
+		    = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+		const __m256i shuf = _mm256_setr_epi8(
+		    -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9,
+		    -1, 2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9);
+		const __m256i alpha = _mm256_set1_epi32(0xff);
+		for (; x + 11 <= w; x += 8) {
+			__m256i v = _mm256_loadu_si256(
+			    (const __m256i *)(row + x * 3));
+			v = _mm256_permutevar8x32_epi32(v, spread);
+			v = _mm256_shuffle_epi8(v, shuf);
+			v = _mm256_or_si256(v, alpha);
+			_mm256_storeu_si256((__m256i *)(pix + x), v);
+		}
 	}
 
-	return pix;
+	return x;
 }
 
-uint32_t *SHYPNM_PbmRawLoad(FILE *f, int *w, int *h)
-{
-	uint32_t *pix = SHYPNM_ReadPbmHeader(f, w, h);
-	if (!pix) {
-		return NULL;
-	}
+#endif
 
-	int     size = (*w) * (*h);
-	uint8_t byte;
+void SHYPNM_ColorRow8(const uint8_t *row, uint32_t *pix, int w, bool get_alpha)
+{
+	// Fast path for maxval 255, where every sample is already in range and
+	// the rescale is an identity, so conversion is only a byte shuffle.
+	int x = 0;
 
-	for (int i = 0; i < size; i++) {
-		if (i % 8 == 0) {
-			if (feof(f)) {
-				fprintf(stderr,
-				        "Error reading Pnm file; unexpected "
-				        "end-of-file encountered while reading "
-				        "pixel data.\n");
-				*w = -1;
-				*h = -1;
-				free(pix);
-				return NULL;
-			}
+#ifdef SHYPNM_HAVE_X86_SIMD
+	switch (SHYPNM_SimdLevel()) {
+	case SHYPNM_SIMDAVX2:
+		x = SHYPNM_ColorRow8Avx2(row, pix, w, get_alpha);
+		break;
+	case SHYPNM_SIMDSSSE3:
+		x = SHYPNM_ColorRow8Ssse3(row, pix, w, get_alpha);
+		break;
+	default:
+		break;
+	}
+	if (x > 0) {
+		SHYPNM_STATMAX(simd, SHYPNM_SimdLevel());
+	}
+#endif
 
-			byte = fgetc(f);
+	if (get_alpha) {
+		for (; x < w; x++) {
+			const uint8_t *p = row + x * 4;
+			pix[x] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+			         | ((uint32_t)p[2] << 8) | p[3];
 		}
-		if (byte & (0x01 << (7 - (i % 8)))) {
-			pix[i] = 0x000000ff;
-		} else {
-			pix[i] = 0xffffffff;
+	} else {
+		for (; x < w; x++) {
+			const uint8_t *p = row + x * 3;
+			pix[x] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+			         | ((uint32_t)p[2] << 8) | 0xff;
 		}
 	}
+}
 
-	return pix;
+#ifdef SHYPNM_HAVE_X86_SIMD
+
+__attribute__((target("ssse3"))) __m128i
+SHYPNM_ScaleVecSsse3(__m128i n, __m128i mul, __m128i shift)
+{
+	// Rescales four 32-bit samples. Each 64-bit product is shifted down to
+	// a result below 256, so the odd results can simply be or'd into the
+	// upper halves of the even ones.
+	n          = _mm_sub_epi32(_mm_slli_epi32(n, 8), n);
+	__m128i lo = _mm_srl_epi64(_mm_mul_epu32(n, mul), shift);
+	__m128i hi = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(n, 32), mul),
+	                           shift);
+	return _mm_or_si128(lo, _mm_slli_epi64(hi, 32));
 }
 
-uint32_t *SHYPNM_PpmAsciiLoad(FILE *f, int *w, int *h)
+__attribute__((target("ssse3"))) size_t
+SHYPNM_ScaleSamplesSsse3(const uint8_t *     row,
+                         uint8_t *           dest,
+                         size_t              n,
+                         const SHYPNM_Scale *scale,
+                         uint32_t *          over)
 {
-	int       maxval;
-	uint32_t *pix = SHYPNM_ReadHeader(f, w, h, &maxval);
-	if (!pix) {
-		return NULL;
+	const __m128i swap = _mm_setr_epi8(
+	    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	const __m128i zero   = _mm_setzero_si128();
+	const __m128i maxval = _mm_set1_epi16(scale->maxval);
+	const __m128i mul    = _mm_set1_epi32(scale->mul);
+	const __m128i shift  = _mm_cvtsi32_si128(scale->shift);
+	__m128i       excess = zero;
+	size_t        i      = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v;
+		if (scale->maxval > UINT8_MAX) {
+			v = _mm_loadu_si128((const __m128i *)(row + i * 2));
+			v = _mm_shuffle_epi8(v, swap);
+		} else {
+			v = _mm_loadl_epi64((const __m128i *)(row + i));
+			v = _mm_unpacklo_epi8(v, zero);
+		}
+		excess = _mm_or_si128(excess, _mm_subs_epu16(v, maxval));
+
+		__m128i lo = SHYPNM_ScaleVecSsse3(
+		    _mm_unpacklo_epi16(v, zero), mul, shift);
+		__m128i hi = SHYPNM_ScaleVecSsse3(
+		    _mm_unpackhi_epi16(v, zero), mul, shift);
+		v = _mm_packus_epi16(_mm_packs_epi32(lo, hi), zero);
+		_mm_storel_epi64((__m128i *)(dest + i), v);
 	}
 
-	int      size = (*w) * (*h);
-	uint32_t r, g, b;
+	*over |= _mm_movemask_epi8(_mm_cmpeq_epi8(excess, zero)) != 0xffff;
+	return i;
+}
 
-	for (int i = 0; i < size; i++) {
-		if (!SHYPNM_GrabAsciiValue(f, maxval, &r)
-		    || !SHYPNM_GrabAsciiValue(f, maxval, &g)
-		    || !SHYPNM_GrabAsciiValue(f, maxval, &b)) {
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
+__attribute__((target("avx2"))) __m256i
+SHYPNM_ScaleVecAvx2(__m256i n, __m256i mul, __m128i shift)
+{
+	n          = _mm256_sub_epi32(_mm256_slli_epi32(n, 8), n);
+	__m256i lo = _mm256_srl_epi64(_mm256_mul_epu32(n, mul), shift);
+	__m256i hi = _mm256_srl_epi64(
+	    _mm256_mul_epu32(_mm256_srli_epi64(n, 32), mul), shift);
+	return _mm256_or_si256(lo, _mm256_slli_epi64(hi, 32));
+}
+
+__attribute__((target("avx2"))) size_t
+SHYPNM_ScaleSamplesAvx2(const uint8_t *     row,
+                        uint8_t *           dest,
+                        size_t              n,
+                        const SHYPNM_Scale *scale,
+                        uint32_t *          over)
+{
+	const __m256i swap = _mm256_setr_epi8(
+	    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	const __m256i zero   = _mm256_setzero_si256();
+	const __m256i maxval = _mm256_set1_epi16(scale->maxval);
+	const __m256i mul    = _mm256_set1_epi32(scale->mul);
+	const __m128i shift  = _mm_cvtsi32_si128(scale->shift);
+	__m256i       excess = zero;
+	size_t        i      = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v;
+		if (scale->maxval > UINT8_MAX) {
+			v = _mm256_loadu_si256((const __m256i *)(row + i * 2));
+			v = _mm256_shuffle_epi8(v, swap);
+		} else {
+			v = _mm256_cvtepu8_epi16(
+			    _mm_loadu_si128((const __m128i *)(row + i)));
 		}
-		pix[i] = (r << 24) | (g << 16) | (b << 8) | 0xff;
+		excess = _mm256_or_si256(excess, _mm256_subs_epu16(v, maxval));
+
+		// Unpacking and packing both work within 128-bit lanes, so the
+		// samples end up back in order after the second pack, apart
+		// from the two 64-bit halves that hold the result.
+		__m256i lo = SHYPNM_ScaleVecAvx2(
+		    _mm256_unpacklo_epi16(v, zero), mul, shift);
+		__m256i hi = SHYPNM_ScaleVecAvx2(
+		    _mm256_unpackhi_epi16(v, zero), mul, shift);
+		v = _mm256_packus_epi16(_mm256_packus_epi32(lo, hi), zero);
+		v = _mm256_permute4x64_epi64(v, 0x08);
+		_mm_storeu_si128((__m128i *)(dest + i),
+		                 _mm256_castsi256_si128(v));
 	}
 
-	return pix;
+	*over |= !_mm256_testz_si256(excess, excess);
+	return i;
 }
 
-uint32_t *SHYPNM_PgmAsciiLoad(FILE *f, int *w, int *h)
+#endif
+
+bool SHYPNM_ScaleSamples(const uint8_t *     row,
+                         uint8_t *           dest,
+                         size_t              n,
+                         const SHYPNM_Scale *scale)
 {
-	int       maxval;
-	uint32_t *pix = SHYPNM_ReadHeader(f, w, h, &maxval);
-	if (!pix) {
-		return NULL;
+	// Rescales n samples of one or two bytes each (depending on maxval)
+	// into 8-bit values, returning false if any sample exceeds maxval. The
+	// range check is accumulated over the whole row, without branches. The
+	// SIMD kernels use the reciprocal, while the scalar code looks samples
+	// up in the table.
+	uint32_t over = 0;
+	size_t   i    = 0;
+
+#ifdef SHYPNM_HAVE_X86_SIMD
+	switch (SHYPNM_SimdLevel()) {
+	case SHYPNM_SIMDAVX2:
+		i = SHYPNM_ScaleSamplesAvx2(row, dest, n, scale, &over);
+		break;
+	case SHYPNM_SIMDSSSE3:
+		i = SHYPNM_ScaleSamplesSsse3(row, dest, n, scale, &over);
+		break;
+	default:
+		break;
+	}
+	if (i > 0) {
+		SHYPNM_STATMAX(simd, SHYPNM_SimdLevel());
+	}
+#endif
+
+	uint32_t v;
+	if (scale->maxval > UINT8_MAX) {
+		for (; i < n; i++) {
+			v = scale->table[(row[i * 2] << 8) | row[i * 2 + 1]];
+			over |= v & SHYPNM_LUTINVALID;
+			dest[i] = v;
+		}
+	} else {
+		for (; i < n; i++) {
+			v = scale->table[row[i]];
+			over |= v & SHYPNM_LUTINVALID;
+			dest[i] = v;
+		}
+	}
+
+	if (over) {
+		fprintf(stderr,
+		        "Error reading Pnm file; pixel value greater than "
+		        "maxval encountered.\n");
+		return false;
+	}
+
+	return true;
+}
+
+#ifdef SHYPNM_HAVE_X86_SIMD
+
+__attribute__((target("ssse3"))) int SHYPNM_GrayscaleRow8Ssse3(
+    const uint8_t *row, uint32_t *pix, int w, bool get_alpha)
+{
+	int x = 0;
+
+	if (get_alpha) {
+		const __m128i lo = _mm_setr_epi8(
+		    1, 0, 0, 0, 3, 2, 2, 2, 5, 4, 4, 4, 7, 6, 6, 6);
+		const __m128i hi = _mm_setr_epi8(
+		    9, 8, 8, 8, 11, 10, 10, 10, 13, 12, 12, 12, 15, 14, 14, 14);
+		for (; x + 8 <= w; x += 8) {
+			__m128i v
+			    = _mm_loadu_si128((const __m128i *)(row + x * 2));
+			_mm_storeu_si128((__m128i *)(pix + x),
+			                 _mm_shuffle_epi8(v, lo));
+			_mm_storeu_si128((__m128i *)(pix + x + 4),
+			                 _mm_shuffle_epi8(v, hi));
+		}
+	} else {
+		const __m128i alpha = _mm_set1_epi32(0xff);
+		__m128i       shuf[4];
+		for (int i = 0; i < 4; i++) {
+			char g = i * 4;
+			shuf[i] = _mm_setr_epi8(-1, g, g, g,
+			                        -1, g + 1, g + 1, g + 1,
+			                        -1, g + 2, g + 2, g + 2,
+			                        -1, g + 3, g + 3, g + 3);
+		}
+		for (; x + 16 <= w; x += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(row + x));
+			for (int i = 0; i < 4; i++) {
+				__m128i p = _mm_shuffle_epi8(v, shuf[i]);
+				_mm_storeu_si128((__m128i *)(pix + x + i * 4),
+				                 _mm_or_si128(p, alpha));
+			}
+		}
 	}
 
-	int      size = (*w) * (*h);
+	return x;
+}
+
+__attribute__((target("avx2"))) int SHYPNM_GrayscaleRow8Avx2(
+    const uint8_t *row, uint32_t *pix, int w, bool get_alpha)
+{
+	// The same 16 input bytes are loaded into both 128-bit lanes, so that
+	// each lane can pick out its own group of four pixels.
+	int x = 0;
+
+	if (get_alpha) {
+		const __m256i shuf = _mm256_setr_epi8(
+		    1, 0, 0, 0, 3, 2, 2, 2, 5, 4, 4, 4, 7, 6, 6, 6,
+		    9, 8, 8, 8, 11, 10, 10, 10, 13, 12, 12, 12, 15, 14, 14, 14);
+		for (; x + 8 <= w; x += 8) {
+			__m256i v = _mm256_broadcastsi128_si256(
+			    _mm_loadu_si128((const __m128i *)(row + x * 2)));
+			_mm256_storeu_si256((__m256i *)(pix + x),
+			                    _mm256_shuffle_epi8(v, shuf));
+		}
+	} else {
+		const __m256i alpha = _mm256_set1_epi32(0xff);
+		const __m256i lo    = _mm256_setr_epi8(
+		    -1, 0, 0, 0, -1, 1, 1, 1, -1, 2, 2, 2, -1, 3, 3, 3,
+		    -1, 4, 4, 4, -1, 5, 5, 5, -1, 6, 6, 6, -1, 7, 7, 7);
+		const __m256i hi = _mm256_setr_epi8(
+		    -1, 8, 8, 8, -1, 9, 9, 9,
+		    -1, 10, 10, 10, -1, 11, 11, 11,
+		    -1, 12, 12, 12, -1, 13, 13, 13,
+		    -1, 14, 14, 14, -1, 15, 15, 15);
+		for (; x + 16 <= w; x += 16) {
+			__m256i v = _mm256_broadcastsi128_si256(
+			    _mm_loadu_si128((const __m128i *)(row + x)));
+			__m256i p = _mm256_shuffle_epi8(v, lo);
+			_mm256_storeu_si256((__m256i *)(pix + x),
+			                    _mm256_or_si256(p, alpha));
+			p = _mm256_shuffle_epi8(v, hi);
+			_mm256_storeu_si256((__m256i *)(pix + x + 8),
+			                    _mm256_or_si256(p, alpha));
+		}
+	}
+
+	return x;
+}
+
+#endif
+
+void SHYPNM_GrayscaleRow8(const uint8_t *row,
+                          uint32_t *     pix,
+                          int            w,
+                          bool           get_alpha)
+{
+	// Gray values are broadcast into the three color channels. This is
+	// used directly for maxval 255, and after rescaling otherwise.
+	int      x = 0;
 	uint32_t gray;
 
-	for (int i = 0; i < size; i++) {
-		if (!SHYPNM_GrabAsciiValue(f, maxval, &gray)) {
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
+#ifdef SHYPNM_HAVE_X86_SIMD
+	switch (SHYPNM_SimdLevel()) {
+	case SHYPNM_SIMDAVX2:
+		x = SHYPNM_GrayscaleRow8Avx2(row, pix, w, get_alpha);
+		break;
+	case SHYPNM_SIMDSSSE3:
+		x = SHYPNM_GrayscaleRow8Ssse3(row, pix, w, get_alpha);
+		break;
+	default:
+		break;
+	}
+	if (x > 0) {
+		SHYPNM_STATMAX(simd, SHYPNM_SimdLevel());
+	}
+#endif
+
+	if (get_alpha) {
+		for (; x < w; x++) {
+			gray   = row[x * 2];
+			pix[x] = (gray << 24) | (gray << 16) | (gray << 8)
+			         | row[x * 2 + 1];
+		}
+	} else {
+		for (; x < w; x++) {
+			gray   = row[x];
+			pix[x] = (gray << 24) | (gray << 16) | (gray << 8)
+			         | 0xff;
 		}
+	}
+}
 
-		pix[i] = (gray << 24) | (gray << 16) | (gray << 8) | 0xff;
+// Expansion table for raw PBM data, giving the eight pixels for every
+// possible byte. Set bits are black and clear bits are white, with the most
+// significant bit being the leftmost pixel.
+#define SHYPNM_BIT(b) ((b) ? 0x000000ffu : 0xffffffffu)
+#define SHYPNM_BITS(n)                                                         \
+	{                                                                      \
+		SHYPNM_BIT((n)&0x80), SHYPNM_BIT((n)&0x40),                    \
+		    SHYPNM_BIT((n)&0x20), SHYPNM_BIT((n)&0x10),                \
+		    SHYPNM_BIT((n)&0x08), SHYPNM_BIT((n)&0x04),                \
+		    SHYPNM_BIT((n)&0x02), SHYPNM_BIT((n)&0x01)                 \
 	}
+#define SHYPNM_BITS4(n)                                                        \
+	SHYPNM_BITS(n), SHYPNM_BITS((n) + 1), SHYPNM_BITS((n) + 2),            \
+	    SHYPNM_BITS((n) + 3)
+#define SHYPNM_BITS16(n)                                                       \
+	SHYPNM_BITS4(n), SHYPNM_BITS4((n) + 4), SHYPNM_BITS4((n) + 8),         \
+	    SHYPNM_BITS4((n) + 12)
+#define SHYPNM_BITS64(n)                                                       \
+	SHYPNM_BITS16(n), SHYPNM_BITS16((n) + 16), SHYPNM_BITS16((n) + 32),    \
+	    SHYPNM_BITS16((n) + 48)
 
-	return pix;
+const uint32_t SHYPNM_BitTable[256][8] = {SHYPNM_BITS64(0),
+                                          SHYPNM_BITS64(64),
+                                          SHYPNM_BITS64(128),
+                                          SHYPNM_BITS64(192)};
+
+void SHYPNM_BitRow(const uint8_t *row, uint32_t *pix, int w)
+{
+	int x = 0;
+
+	for (; x + 8 <= w; x += 8) {
+		memcpy(pix + x,
+		       SHYPNM_BitTable[row[x / 8]],
+		       sizeof(uint32_t) * 8);
+	}
+	if (x < w) {
+		memcpy(pix + x,
+		       SHYPNM_BitTable[row[x / 8]],
+		       sizeof(uint32_t) * (w - x));
+	}
 }
 
-uint32_t *SHYPNM_PbmAsciiLoad(FILE *f, int *w, int *h)
+size_t SHYPNM_RowSize(int w, int depth, int maxval)
 {
-	uint32_t *pix = SHYPNM_ReadPbmHeader(f, w, h);
-	if (!pix) {
-		return NULL;
+	// Returns the size in bytes of one row of a binary raster. A depth of 0
+	// is used for raw PBM data, where each row is a byte-padded bitmap.
+	if (depth == 0) {
+		return ((size_t)w + 7) / 8;
+	} else {
+		return (size_t)w * depth * (maxval > UINT8_MAX ? 2 : 1);
+	}
+}
+
+bool SHYPNM_DecodeRow(const uint8_t *     row,
+                      uint8_t *           scaled,
+                      uint32_t *          pix,
+                      int                 w,
+                      int                 depth,
+                      const SHYPNM_Scale *scale)
+{
+	// Unless maxval is 255, samples are first rescaled into the scaled row
+	// of 8-bit values, which is then packed into pixels.
+	if (depth == 0) {
+		SHYPNM_BitRow(row, pix, w);
+		return true;
+	}
+
+	size_t samples = (size_t)w * depth;
+	if (scale->maxval != UINT8_MAX) {
+		if (!SHYPNM_ScaleSamples(row, scaled, samples, scale)) {
+			return false;
+		}
+		row = scaled;
+	}
+	if (depth < 3) {
+		SHYPNM_GrayscaleRow8(row, pix, w, depth == 2);
+	} else {
+		SHYPNM_ColorRow8(row, pix, w, depth == 4);
+	}
+
+	return true;
+}
+
+bool SHYPNM_PrepareScale(int           maxval,
+                         int           depth,
+                         SHYPNM_Scale *scale,
+                         SHYPNM_Lut ** lut)
+{
+	// Sets up the rescale for a binary raster, acquiring a lookup table
+	// unless the samples can be used as they are.
+	*scale = SHYPNM_MakeScale(maxval);
+	*lut   = NULL;
+
+	if (depth > 0 && maxval != UINT8_MAX) {
+		*lut = SHYPNM_AcquireLut(maxval);
+		if (!*lut) {
+			return false;
+		}
+		scale->table = (*lut)->table;
+	}
+
+	return true;
+}
+
+// A row reader decodes the raster following a parsed header into rows of
+// pixels, one or more at a time, keeping only a row's worth of scratch data.
+// Binary rows are read whole and converted with SHYPNM_DecodeRow(), plain PGM
+// and PPM rows are tokenized into 8-bit samples first, and plain PBM rows are
+// read one character at a time.
+typedef struct {
+	SHYPNM_Source *src;
+	SHYPNM_Header  hdr;
+	int            depth;
+	size_t         rowsize;
+	SHYPNM_Scale   scale;
+	SHYPNM_Lut *   lut;
+	uint8_t *      buf;
+	uint8_t *      samples;
+	uint8_t *      narrow;
+	uint16_t *     wide;
+	uint16_t *     widen;
+} SHYPNM_RowReader;
+
+bool SHYPNM_OpenRows(SHYPNM_RowReader *   rd,
+                     SHYPNM_Source *      src,
+                     const SHYPNM_Header *hdr)
+{
+	// Raw PBM rows are bitmaps, which are decoded with a depth of 0.
+	bool text = hdr->magic == '2' || hdr->magic == '3';
+
+	memset(rd, 0, sizeof(*rd));
+	rd->src     = src;
+	rd->hdr     = *hdr;
+	rd->depth   = hdr->magic == '4' ? 0 : hdr->depth;
+	rd->rowsize = SHYPNM_RowSize(hdr->w, rd->depth, hdr->maxval);
+
+	// Plain PBM rows are read into the sample row as 0s and 1s.
+	bool pbm = hdr->magic == '1';
+	if (text) {
+		rd->lut = SHYPNM_AcquireLut(hdr->maxval);
+		if (!rd->lut) {
+			return false;
+		}
+	} else if (!pbm
+	           && !SHYPNM_PrepareScale(
+	               hdr->maxval, rd->depth, &rd->scale, &rd->lut)) {
+		return false;
 	}
 
-	int size = (*w) * (*h);
+	if (rd->lut || pbm) {
+		rd->samples = SHYPNM_MALLOC((size_t)hdr->w * hdr->depth);
+	}
+	if (src->f && !text && !pbm) {
+		rd->buf = SHYPNM_MALLOC(rd->rowsize);
+	}
+	if (((rd->lut || pbm) && !rd->samples)
+	    || (src->f && !text && !pbm && !rd->buf)) {
+		perror(strerror(errno));
+		SHYPNM_ReleaseLut(rd->lut);
+		SHYPNM_FREE(rd->samples);
+		SHYPNM_FREE(rd->buf);
+		return false;
+	}
+
+	return true;
+}
+
+void SHYPNM_CloseRows(SHYPNM_RowReader *rd)
+{
+	SHYPNM_ReleaseLut(rd->lut);
+	SHYPNM_FREE(rd->samples);
+	SHYPNM_FREE(rd->buf);
+	SHYPNM_FREE(rd->narrow);
+	SHYPNM_FREE(rd->wide);
+	SHYPNM_FREE(rd->widen);
+}
 
-	for (int i = 0; i < size;) {
-		switch (fgetc(f)) {
+bool SHYPNM_PbmAsciiRow(SHYPNM_RowReader *rd, uint8_t *ink)
+{
+	for (int x = 0; x < rd->hdr.w;) {
+		switch (SHYPNM_Getc(rd->src)) {
 		case -1:
 			fprintf(
 			    stderr,
 			    "Error reading Pnm file; unexpected end-of-file "
 			    "encountered while reading pixel data.\n");
-			*w = -1;
-			*h = -1;
-			free(pix);
-			return NULL;
+			return false;
 		case '#':
-			while (fgetc(f) != '\n')
-				;
+			SHYPNM_SkipComment(rd->src);
 			break;
 		case '0':
-			pix[i] = 0xffffffff;
-			i++;
+			ink[x] = 0;
+			x++;
 			break;
 		case '1':
-			pix[i] = 0x000000ff;
-			i++;
+			ink[x] = 1;
+			x++;
 			break;
 		default:
 			break;
 		}
 	}
 
-	return pix;
+	return true;
 }
 
-uint32_t *PnmLoad(const char *filename, int *w, int *h)
+bool SHYPNM_TextSamples(SHYPNM_RowReader *rd)
 {
-	FILE *f = fopen(filename, "rb");
-	if (!f) {
-		fprintf(stderr, "Error opening file '%s'.\n", filename);
-		return NULL;
+	// Reads a plain row into 8-bit samples. Rows in memory are tokenized
+	// in bulk, while file sources are read one value at a time.
+	SHYPNM_Source *src = rd->src;
+	size_t         n   = (size_t)rd->hdr.w * rd->hdr.depth;
+
+	if (!src->f) {
+		const uint8_t *p   = src->data + src->pos;
+		const uint8_t *end = src->data + src->size;
+
+		bool ok  = SHYPNM_ScanSamples(&p, end, rd->lut, rd->samples, n);
+		src->pos = p - src->data;
+		if (!ok) {
+			return false;
+		}
+	} else {
+		for (size_t i = 0; i < n; i++) {
+			uint32_t v;
+			if (!SHYPNM_GrabAsciiValue(src, rd->lut, &v)) {
+				return false;
+			}
+			rd->samples[i] = v;
+		}
+	}
+
+	return true;
+}
+
+bool SHYPNM_TextRow(SHYPNM_RowReader *rd, uint32_t *pix)
+{
+	if (!SHYPNM_TextSamples(rd)) {
+		return false;
+	}
+
+	if (rd->hdr.depth == 1) {
+		SHYPNM_GrayscaleRow8(rd->samples, pix, rd->hdr.w, false);
+	} else {
+		SHYPNM_ColorRow8(rd->samples, pix, rd->hdr.w, false);
 	}
+	return true;
+}
 
-	if (fgetc(f) != 'P') {
+const uint8_t *SHYPNM_RawRow(SHYPNM_RowReader *rd)
+{
+	// Returns the next binary row. File sources read each row into a
+	// scratch buffer with a single fread(), while memory sources are
+	// used in place.
+	const uint8_t *row = SHYPNM_Read(rd->src, rd->buf, rd->rowsize);
+	if (!row) {
 		fprintf(stderr,
-		        "File '%s' is not a valid pnm file. Invalid magic "
-		        "number encountered.\n",
-		        filename);
-		fclose(f);
-		return NULL;
+		        "Error reading Pnm file; unexpected end-of-file "
+		        "reached while reading pixel data.\n");
+	}
+
+	return row;
+}
+
+bool SHYPNM_RasterRow(SHYPNM_RowReader *rd, uint32_t *pix)
+{
+	const uint8_t *row = SHYPNM_RawRow(rd);
+	if (!row) {
+		return false;
+	}
+
+	return SHYPNM_DecodeRow(
+	    row, rd->samples, pix, rd->hdr.w, rd->depth, &rd->scale);
+}
+
+bool SHYPNM_ReadRows(SHYPNM_RowReader *rd, uint32_t *pix, int rows)
+{
+	// Decodes the next rows of the raster into consecutive rows of pix.
+	SHYPNM_STATENTER(SHYPNM_PHASEDECODE);
+	bool ok = true;
+	for (int y = 0; ok && y < rows; y++) {
+		uint32_t *row = pix + (size_t)y * rd->hdr.w;
+
+		switch (rd->hdr.magic) {
+		case '1':
+			ok = SHYPNM_PbmAsciiRow(rd, rd->samples);
+			for (int x = 0; ok && x < rd->hdr.w; x++) {
+				bool ink = rd->samples[x];
+				row[x]   = ink ? 0x000000ff : 0xffffffff;
+			}
+			break;
+		case '2':
+		case '3':
+			ok = SHYPNM_TextRow(rd, row);
+			break;
+		default:
+			ok = SHYPNM_RasterRow(rd, row);
+			break;
+		}
+	}
+	SHYPNM_STATLEAVE();
+
+	return ok;
+}
+
+// Rows can also be decoded into the other pixel formats of PnmLoadEx(). 8-bit
+// formats are packed from rows of 8-bit samples, rescaled as for PnmLoad(),
+// while 16-bit formats are packed from samples rescaled from 0-maxval to
+// 0-65535, keeping the full precision of 16-bit images. Grayscale is copied
+// into every color channel, color is reduced to Rec. 601 luma, and missing
+// alpha is opaque. Bitmaps mark pixels darker than half intensity.
+size_t SHYPNM_FormatRowSize(int format, int w)
+{
+	static const int bytes[] = {4, 1, 2, 3, 4, 6, 8};
+
+	if (format == PNM_BIT1) {
+		return ((size_t)w + 7) / 8;
+	}
+	return (size_t)w * bytes[format];
+}
+
+int SHYPNM_FormatChannels(int format)
+{
+	static const int channels[] = {4, 1, 1, 3, 4, 3, 4, 1};
+	return channels[format];
+}
+
+bool SHYPNM_FormatWide(int format)
+{
+	return format == PNM_GRAY16 || format == PNM_RGB16
+	       || format == PNM_RGBA16;
+}
+
+bool SHYPNM_SetFormat(SHYPNM_RowReader *rd, int format)
+{
+	// Allocates the scratch rows needed for format, and the table which
+	// rescales samples to 16 bits.
+	size_t n = (size_t)rd->hdr.w * rd->hdr.depth;
+
+	if (format == PNM_RGBA32) {
+		return true;
+	}
+
+	rd->narrow = SHYPNM_MALLOC(n);
+	if (rd->narrow && SHYPNM_FormatWide(format)) {
+		size_t levels = (size_t)rd->hdr.maxval + 1;
+		rd->wide      = SHYPNM_MALLOC(n * sizeof(uint16_t));
+		rd->widen     = SHYPNM_MALLOC(levels * sizeof(uint16_t));
+		if (!rd->wide || !rd->widen) {
+			perror(strerror(errno));
+			return false;
+		}
+		for (uint32_t v = 0; v <= (uint32_t)rd->hdr.maxval; v++) {
+			rd->widen[v] = v * UINT16_MAX / rd->hdr.maxval;
+		}
+	} else if (!rd->narrow) {
+		perror(strerror(errno));
+		return false;
 	}
 
-	uint32_t *pix = NULL;
+	return true;
+}
+
+const uint8_t *SHYPNM_NarrowRow(SHYPNM_RowReader *rd)
+{
+	// Returns the next row as 8-bit samples, with bitmaps expanded to
+	// grayscale, or NULL on errors.
+	const uint8_t *row;
+	int            w = rd->hdr.w;
 
-	switch (fgetc(f)) {
+	switch (rd->hdr.magic) {
 	case '1':
-		pix = SHYPNM_PbmAsciiLoad(f, w, h);
-		break;
+		if (!SHYPNM_PbmAsciiRow(rd, rd->narrow)) {
+			return NULL;
+		}
+		for (int x = 0; x < w; x++) {
+			rd->narrow[x] = rd->narrow[x] ? 0 : UINT8_MAX;
+		}
+		return rd->narrow;
 	case '2':
-		pix = SHYPNM_PgmAsciiLoad(f, w, h);
-		break;
 	case '3':
-		pix = SHYPNM_PpmAsciiLoad(f, w, h);
-		break;
+		return SHYPNM_TextSamples(rd) ? rd->samples : NULL;
 	case '4':
-		pix = SHYPNM_PbmRawLoad(f, w, h);
-		break;
-	case '5':
-		pix = SHYPNM_PgmRawLoad(f, w, h);
-		break;
-	case '6':
-		pix = SHYPNM_PpmRawLoad(f, w, h);
-		break;
-	case '7':
-		pix = SHYPNM_PamLoad(f, w, h);
-		break;
+		row = SHYPNM_RawRow(rd);
+		if (!row) {
+			return NULL;
+		}
+		for (int x = 0; x < w; x++) {
+			bool ink      = (row[x / 8] >> (7 - x % 8)) & 1;
+			rd->narrow[x] = ink ? 0 : UINT8_MAX;
+		}
+		return rd->narrow;
 	default:
-		fprintf(stderr,
-		        "File '%s' is not a valid pnm file. Invalid magic "
-		        "number encountered.\n",
-		        filename);
-		break;
+		row = SHYPNM_RawRow(rd);
+		if (!row || rd->hdr.maxval == UINT8_MAX) {
+			return row;
+		}
+		size_t n = (size_t)w * rd->hdr.depth;
+		if (!SHYPNM_ScaleSamples(row, rd->samples, n, &rd->scale)) {
+			return NULL;
+		}
+		return rd->samples;
 	}
+}
 
-	fclose(f);
+const uint16_t *SHYPNM_WideRow(SHYPNM_RowReader *rd)
+{
+	// Returns the next row as samples rescaled to 0-65535, or NULL on
+	// errors.
+	size_t         n = (size_t)rd->hdr.w * rd->hdr.depth;
+	const uint8_t *row;
 
-	return pix;
-}
+	switch (rd->hdr.magic) {
+	case '1':
+	case '4':
+		row = SHYPNM_NarrowRow(rd);
+		if (!row) {
+			return NULL;
+		}
+		for (size_t i = 0; i < n; i++) {
+			rd->wide[i] = row[i] * 0x101;
+		}
+		return rd->wide;
+	case '2':
+	case '3':
+		for (size_t i = 0; i < n; i++) {
+			int v = SHYPNM_GrabInt(rd->src);
+			if (v < 0) {
+				return NULL;
+			} else if (v > rd->hdr.maxval) {
+				fprintf(stderr,
+				        "Error reading Pnm file; pixel value "
+				        "greater than maxval encountered.\n");
+				return NULL;
+			}
+			rd->wide[i] = rd->widen[v];
+		}
+		return rd->wide;
+	default:
+		row = SHYPNM_RawRow(rd);
+		if (!row) {
+			return NULL;
+		}
+		for (size_t i = 0; i < n; i++) {
+			uint32_t v = row[i];
+			if (rd->hdr.maxval > UINT8_MAX) {
+				v = (row[2 * i] << 8) | row[2 * i + 1];
+			}
+			if (v > (uint32_t)rd->hdr.maxval) {
+				fprintf(stderr,
+				        "Error reading Pnm file; pixel value "
+				        "greater than maxval encountered.\n");
+				return NULL;
+			}
+			rd->wide[i] = rd->widen[v];
+		}
+		return rd->wide;
+	}
+}
+
+// Rows are packed with a separate loop for every pair of depth and channel
+// count, which lets the compiler vectorize them. The same loops serve both
+// sample widths.
+#define SHYPNM_PACKROW(s, depth, dest, channels, w, max, luma)                 \
+	switch ((depth) * 8 + (channels)) {                                    \
+	case 1 * 8 + 2:                                                        \
+		for (int x = 0; x < (w); x++) {                                \
+			dest[x * 2]     = s[x];                                \
+			dest[x * 2 + 1] = (max);                               \
+		}                                                              \
+		break;                                                         \
+	case 3 * 8 + 2:                                                        \
+	case 4 * 8 + 2:                                                        \
+		for (int x = 0; x < (w); x++) {                                \
+			dest[x * 2] = luma(s[x * depth],                       \
+			                   s[x * depth + 1],                   \
+			                   s[x * depth + 2]);                  \
+			dest[x * 2 + 1]                                        \
+			    = depth == 4 ? s[x * 4 + 3] : (max);               \
+		}                                                              \
+		break;                                                         \
+	case 1 * 8 + 3:                                                        \
+	case 1 * 8 + 4:                                                        \
+	case 2 * 8 + 3:                                                        \
+	case 2 * 8 + 4:                                                        \
+		for (int x = 0; x < (w); x++) {                                \
+			dest[x * channels]     = s[x * depth];                 \
+			dest[x * channels + 1] = s[x * depth];                 \
+			dest[x * channels + 2] = s[x * depth];                 \
+			if (channels == 4) {                                   \
+				dest[x * 4 + 3]                                \
+				    = depth == 2 ? s[x * 2 + 1] : (max);       \
+			}                                                      \
+		}                                                              \
+		break;                                                         \
+	case 2 * 8 + 1:                                                        \
+		for (int x = 0; x < (w); x++) {                                \
+			dest[x] = s[x * 2];                                    \
+		}                                                              \
+		break;                                                         \
+	case 3 * 8 + 1:                                                        \
+	case 4 * 8 + 1:                                                        \
+		for (int x = 0; x < (w); x++) {                                \
+			dest[x] = luma(s[x * depth],                           \
+			               s[x * depth + 1],                       \
+			               s[x * depth + 2]);                      \
+		}                                                              \
+		break;                                                         \
+	case 3 * 8 + 4:                                                        \
+	case 4 * 8 + 3:                                                        \
+		for (int x = 0; x < (w); x++) {                                \
+			dest[x * channels]     = s[x * depth];                 \
+			dest[x * channels + 1] = s[x * depth + 1];             \
+			dest[x * channels + 2] = s[x * depth + 2];             \
+			if (channels == 4) {                                   \
+				dest[x * 4 + 3] = (max);                       \
+			}                                                      \
+		}                                                              \
+		break;                                                         \
+	default:                                                               \
+		memmove(dest, s, (size_t)(w) * (depth) * sizeof(*s));         \
+		break;                                                         \
+	}
+
+#define SHYPNM_LUMA8(r, g, b) ((77 * (r) + 150 * (g) + 29 * (b) + 128) >> 8)
+#define SHYPNM_LUMA16(r, g, b)                                                 \
+	((19595 * (uint32_t)(r) + 38470 * (uint32_t)(g)                        \
+	  + 7471 * (uint32_t)(b) + 32768)                                      \
+	 >> 16)
+
+void SHYPNM_PackRow8(
+    const uint8_t *s, int depth, uint8_t *dest, int channels, int w)
+{
+	SHYPNM_PACKROW(s, depth, dest, channels, w, UINT8_MAX, SHYPNM_LUMA8);
+}
+
+void SHYPNM_PackRow16(
+    const uint16_t *s, int depth, uint16_t *dest, int channels, int w)
+{
+	SHYPNM_PACKROW(s, depth, dest, channels, w, UINT16_MAX, SHYPNM_LUMA16);
+}
+
+bool SHYPNM_BitmapRow(SHYPNM_RowReader *rd, uint8_t *dest)
+{
+	// Raw PBM rows are copied as they are, while anything else is reduced
+	// to gray and thresholded, eight pixels to a byte.
+	int w = rd->hdr.w;
+
+	if (rd->hdr.magic == '4') {
+		const uint8_t *row = SHYPNM_RawRow(rd);
+		if (row) {
+			memcpy(dest, row, rd->rowsize);
+		}
+		return row != NULL;
+	}
+
+	const uint8_t *row = SHYPNM_NarrowRow(rd);
+	if (!row) {
+		return false;
+	} else if (rd->hdr.depth > 1) {
+		SHYPNM_PackRow8(row, rd->hdr.depth, rd->narrow, 1, w);
+		row = rd->narrow;
+	}
+
+	for (int x = 0; x < w; x += 8) {
+		uint8_t bits = 0;
+		for (int i = 0; i < 8; i++) {
+			bits |= (x + i < w && row[x + i] < 0x80) << (7 - i);
+		}
+		dest[x / 8] = bits;
+	}
+	return true;
+}
+
+bool SHYPNM_ReadRowAs(SHYPNM_RowReader *rd, void *dest, int format)
+{
+	// Decodes the next row of the raster into dest, in the given format.
+	// Binary rows already in that format are read straight into dest.
+	const SHYPNM_Header *hdr      = &rd->hdr;
+	int                  channels = SHYPNM_FormatChannels(format);
+	bool                 direct   = format == PNM_BIT1 && hdr->magic == '4';
+
+	if (hdr->magic >= '5' && hdr->maxval == UINT8_MAX
+	    && hdr->depth == channels && format != PNM_RGBA32
+	    && format != PNM_BIT1 && !SHYPNM_FormatWide(format)) {
+		direct = true;
+	}
+
+	if (direct) {
+		const uint8_t *row = SHYPNM_Read(rd->src, dest, rd->rowsize);
+		if (!row) {
+			fprintf(stderr,
+			        "Error reading Pnm file; unexpected "
+			        "end-of-file reached while reading pixel "
+			        "data.\n");
+			return false;
+		} else if (row != dest) {
+			memcpy(dest, row, rd->rowsize);
+		}
+		return true;
+	} else if (format == PNM_RGBA32) {
+		return SHYPNM_ReadRows(rd, dest, 1);
+	} else if (format == PNM_BIT1) {
+		return SHYPNM_BitmapRow(rd, dest);
+	} else if (SHYPNM_FormatWide(format)) {
+		const uint16_t *row = SHYPNM_WideRow(rd);
+		if (row) {
+			SHYPNM_PackRow16(
+			    row, rd->hdr.depth, dest, channels, rd->hdr.w);
+		}
+		return row != NULL;
+	} else {
+		const uint8_t *row = SHYPNM_NarrowRow(rd);
+		if (row) {
+			SHYPNM_PackRow8(
+			    row, rd->hdr.depth, dest, channels, rd->hdr.w);
+		}
+		return row != NULL;
+	}
+}
+
+uint32_t *SHYPNM_Load(SHYPNM_Source *src, const char *name, int *w, int *h)
+{
+	SHYPNM_Header    hdr;
+	SHYPNM_RowReader rd;
+	uint32_t *       pix = NULL;
+
+	if (SHYPNM_ParseHeader(src, name, &hdr)) {
+		pix = SHYPNM_AllocPixels(hdr.w, hdr.h);
+	}
+	if (pix && SHYPNM_OpenRows(&rd, src, &hdr)) {
+		if (!SHYPNM_ReadRows(&rd, pix, hdr.h)) {
+			SHYPNM_FREE(pix);
+			pix = NULL;
+		}
+		SHYPNM_CloseRows(&rd);
+	} else {
+		SHYPNM_FREE(pix);
+		pix = NULL;
+	}
+
+	*w = pix ? hdr.w : -1;
+	*h = pix ? hdr.h : -1;
+	return pix;
+}
+
+uint32_t *PnmLoadMemory(const void *data, size_t len, int *w, int *h)
+{
+	SHYPNM_Source src = SHYPNM_MemorySource(data, len);
+	return SHYPNM_Load(&src, "<memory>", w, h);
+}
+
+uint32_t *PnmLoad(const char *filename, int *w, int *h)
+{
+	FILE *f = SHYPNM_OpenFile(filename);
+	if (!f) {
+		return NULL;
+	}
+
+	SHYPNM_Source src = SHYPNM_FileSource(f);
+	uint32_t *    pix = SHYPNM_Load(&src, filename, w, h);
+
+	fclose(f);
+
+	return pix;
+}
+
+#ifdef SHYPNM_HAVE_MMAP
+
+int SHYPNM_OpenFd(const char *filename)
+{
+	SHYPNM_STATENTER(SHYPNM_PHASEOPEN);
+	SHYPNM_STATADD(io_calls, 1);
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening file '%s'.\n", filename);
+	}
+
+	SHYPNM_STATLEAVE();
+	return fd;
+}
+
+bool SHYPNM_Pread(int fd, uint8_t *buf, size_t n, off_t offset)
+{
+	while (n) {
+		SHYPNM_STATADD(io_calls, 1);
+		ssize_t got = pread(fd, buf, n, offset);
+		if (got < 0 && errno == EINTR) {
+			continue;
+		} else if (got <= 0) {
+			return false;
+		}
+		SHYPNM_STATADD(bytes_read, got);
+		buf += got;
+		n -= got;
+		offset += got;
+	}
+
+	return true;
+}
+
+uint32_t *PnmLoadMapped(const char *filename, int *w, int *h)
+{
+	int fd = SHYPNM_OpenFd(filename);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		perror(strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	// Empty files cannot be mapped, but still need to be reported as
+	// invalid, so they are parsed as an empty range instead.
+	size_t size = st.st_size;
+	void * data = NULL;
+	if (size) {
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			perror(strerror(errno));
+			close(fd);
+			return NULL;
+		}
+		SHYPNM_STATADD(io_calls, 1);
+		SHYPNM_STATADD(bytes_read, size);
+#ifdef MADV_SEQUENTIAL
+		madvise(data, size, MADV_SEQUENTIAL);
+#endif
+	}
+
+	SHYPNM_Source src = SHYPNM_MemorySource(data, size);
+	uint32_t *    pix = SHYPNM_Load(&src, filename, w, h);
+
+	if (data) {
+		munmap(data, size);
+	}
+	close(fd);
+
+	return pix;
+}
+
+#else
+
+uint32_t *PnmLoadMapped(const char *filename, int *w, int *h)
+{
+	// Memory mapping is unavailable on this platform, so fall back to
+	// regular file reading.
+	return PnmLoad(filename, w, h);
+}
+
+#endif
+
+bool SHYPNM_ReadAt(FILE *f, uint8_t *buf, size_t n, uint64_t offset)
+{
+	// Reads n bytes at the given offset into the file, using pread() where
+	// it is available so that stdio does not refill its buffer each time.
+#ifdef SHYPNM_HAVE_MMAP
+	return SHYPNM_Pread(fileno(f), buf, n, offset);
+#else
+	return fseek(f, (long)offset, SEEK_SET) == 0
+	       && fread(buf, 1, n, f) == n;
+#endif
+}
+
+bool SHYPNM_RasterRegion(FILE *               f,
+                         const SHYPNM_Header *hdr,
+                         uint32_t *           pix,
+                         int                  x,
+                         int                  y,
+                         int                  rw,
+                         int                  rh)
+{
+	// Binary rows all have the same size, so only the bytes holding the
+	// region are read from each row. Bitmap rows are decoded from the byte
+	// holding the first pixel, and the leading pixels are dropped.
+	int      depth = hdr->magic == '4' ? 0 : hdr->depth;
+	uint64_t start = ftell(f);
+	size_t   size  = SHYPNM_RowSize(hdr->w, depth, hdr->maxval);
+	size_t   first = SHYPNM_RowSize(x, depth, hdr->maxval);
+	size_t   span  = SHYPNM_RowSize(rw, depth, hdr->maxval);
+	int      skip  = 0;
+	if (depth == 0) {
+		first = x / 8;
+		skip  = x % 8;
+		span  = SHYPNM_RowSize(skip + rw, 0, 1);
+	}
+
+	SHYPNM_Scale scale;
+	SHYPNM_Lut * lut;
+	if (!SHYPNM_PrepareScale(hdr->maxval, depth, &scale, &lut)) {
+		return false;
+	}
+
+	uint8_t * buf    = SHYPNM_MALLOC(span);
+	uint8_t * scaled = NULL;
+	uint32_t *bits   = NULL;
+	if (lut) {
+		scaled = SHYPNM_MALLOC((size_t)rw * depth);
+	}
+	if (skip) {
+		bits = SHYPNM_MALLOC((skip + rw) * sizeof(uint32_t));
+	}
+
+	bool ok = buf && (!lut || scaled) && (!skip || bits);
+	if (!ok) {
+		perror(strerror(errno));
+	}
+
+	SHYPNM_STATENTER(SHYPNM_PHASEDECODE);
+	for (int i = 0; ok && i < rh; i++) {
+		uint32_t *row    = pix + (size_t)i * rw;
+		uint64_t  offset = start + size * (y + i) + first;
+
+		ok = SHYPNM_ReadAt(f, buf, span, offset);
+		if (!ok) {
+			fprintf(stderr,
+			        "Error reading Pnm file; unexpected "
+			        "end-of-file reached while reading pixel "
+			        "data.\n");
+		} else if (skip) {
+			SHYPNM_BitRow(buf, bits, skip + rw);
+			memcpy(row, bits + skip, rw * sizeof(uint32_t));
+		} else {
+			ok = SHYPNM_DecodeRow(
+			    buf, scaled, row, rw, depth, &scale);
+		}
+	}
+	SHYPNM_STATLEAVE();
+
+	SHYPNM_ReleaseLut(lut);
+	SHYPNM_FREE(buf);
+	SHYPNM_FREE(scaled);
+	SHYPNM_FREE(bits);
+	return ok;
+}
+
+bool SHYPNM_TextRegion(SHYPNM_Source *      src,
+                       const SHYPNM_Header *hdr,
+                       uint32_t *           pix,
+                       int                  x,
+                       int                  y,
+                       int                  rw,
+                       int                  rh)
+{
+	// Plain rows vary in length, so every row up to the end of the region
+	// is decoded, one at a time.
+	SHYPNM_RowReader rd;
+	if (!SHYPNM_OpenRows(&rd, src, hdr)) {
+		return false;
+	}
+
+	uint32_t *row = SHYPNM_AllocPixels(hdr->w, 1);
+	bool      ok  = row != NULL;
+	for (int i = 0; ok && i < y + rh; i++) {
+		ok = SHYPNM_ReadRows(&rd, row, 1);
+		if (ok && i >= y) {
+			memcpy(pix + (size_t)(i - y) * rw,
+			       row + x,
+			       rw * sizeof(uint32_t));
+		}
+	}
+
+	SHYPNM_FREE(row);
+	SHYPNM_CloseRows(&rd);
+	return ok;
+}
+
+uint32_t *PnmLoadRegion(
+    const char *filename, int x, int y, int rw, int rh, int *w, int *h)
+{
+	*w = -1;
+	*h = -1;
+
+	FILE *f = SHYPNM_OpenFile(filename);
+	if (!f) {
+		return NULL;
+	}
+
+	SHYPNM_Source src = SHYPNM_FileSource(f);
+	SHYPNM_Header hdr;
+	if (!SHYPNM_ParseHeader(&src, filename, &hdr)) {
+		fclose(f);
+		return NULL;
+	}
+
+	// Regions reaching past the right or bottom edge are clipped.
+	if (x < 0 || y < 0 || rw < 1 || rh < 1 || x >= hdr.w || y >= hdr.h) {
+		fprintf(stderr,
+		        "Error reading Pnm file; region lies outside the "
+		        "image.\n");
+		fclose(f);
+		return NULL;
+	}
+	if (rw > hdr.w - x) {
+		rw = hdr.w - x;
+	}
+	if (rh > hdr.h - y) {
+		rh = hdr.h - y;
+	}
+
+	uint32_t *pix = SHYPNM_AllocPixels(rw, rh);
+	bool      ok  = pix != NULL;
+	if (ok && hdr.magic <= '3') {
+		ok = SHYPNM_TextRegion(&src, &hdr, pix, x, y, rw, rh);
+	} else if (ok) {
+		ok = SHYPNM_RasterRegion(f, &hdr, pix, x, y, rw, rh);
+	}
+	if (!ok) {
+		SHYPNM_FREE(pix);
+		pix = NULL;
+	}
+
+	*w = pix ? rw : -1;
+	*h = pix ? rh : -1;
+	fclose(f);
+	return pix;
+}
+
+// Streamed images are decoded into a buffer of about SHYPNM_STREAMBATCH bytes,
+// which holds at least one row.
+#define SHYPNM_STREAMBATCH (1 << 16)
+
+bool SHYPNM_OpenSource(const PnmSource *source,
+                       SHYPNM_Source *  src,
+                       const char **    name)
+{
+	if (source->data) {
+		*src  = SHYPNM_MemorySource(source->data, source->size);
+		*name = "<memory>";
+	} else if (source->file) {
+		*src  = SHYPNM_FileSource(source->file);
+		*name = "<file>";
+	} else {
+		FILE *f = SHYPNM_OpenFile(source->filename);
+		if (!f) {
+			return false;
+		}
+		*src  = SHYPNM_FileSource(f);
+		*name = source->filename;
+	}
+
+	return true;
+}
+
+void SHYPNM_CloseSource(const PnmSource *source, SHYPNM_Source *src)
+{
+	// Only files opened by SHYPNM_OpenSource() are closed.
+	if (!source->data && !source->file) {
+		fclose(src->f);
+	}
+}
+
+int PnmProbe(const PnmSource *source, PnmInfo *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->w = -1;
+	info->h = -1;
+
+	SHYPNM_Source src;
+	const char *  name;
+	if (!SHYPNM_OpenSource(source, &src, &name)) {
+		return 0;
+	}
+
+	SHYPNM_Header hdr;
+	size_t        start = SHYPNM_Tell(&src);
+	bool          ok    = SHYPNM_ParseHeader(&src, name, &hdr);
+	if (ok) {
+		info->magic  = hdr.magic;
+		info->w      = hdr.w;
+		info->h      = hdr.h;
+		info->depth  = hdr.depth;
+		info->maxval = hdr.maxval;
+		info->offset = SHYPNM_Tell(&src) - start;
+		memcpy(info->tupltype, hdr.tupltype, sizeof(info->tupltype));
+		if (hdr.magic >= '4') {
+			int    depth = hdr.magic == '4' ? 0 : hdr.depth;
+			size_t row   = SHYPNM_RowSize(hdr.w, depth, hdr.maxval);
+			info->size   = (uint64_t)row * hdr.h;
+		}
+	}
+
+	SHYPNM_CloseSource(source, &src);
+	return ok;
+}
+
+bool SHYPNM_DecodeInto(SHYPNM_RowReader *rd,
+                       void *            dst,
+                       size_t            stride,
+                       int               format)
+{
+	if (!SHYPNM_SetFormat(rd, format)) {
+		return false;
+	}
+
+	SHYPNM_STATENTER(SHYPNM_PHASEDECODE);
+	bool ok = true;
+	for (int y = 0; ok && y < rd->hdr.h; y++) {
+		void *row = (uint8_t *)dst + stride * y;
+		ok        = SHYPNM_ReadRowAs(rd, row, format);
+	}
+	SHYPNM_STATLEAVE();
+
+	return ok;
+}
+
+void *PnmLoadEx(const PnmSource *source, int format, int *w, int *h)
+{
+	*w = -1;
+	*h = -1;
+	if (format < PNM_RGBA32 || format > PNM_BIT1) {
+		fprintf(stderr, "Error loading Pnm file; unknown format.\n");
+		return NULL;
+	}
+
+	SHYPNM_Source src;
+	const char *  name;
+	if (!SHYPNM_OpenSource(source, &src, &name)) {
+		return NULL;
+	}
+
+	SHYPNM_Header    hdr;
+	SHYPNM_RowReader rd;
+	if (!SHYPNM_ParseHeader(&src, name, &hdr)
+	    || !SHYPNM_OpenRows(&rd, &src, &hdr)) {
+		SHYPNM_CloseSource(source, &src);
+		return NULL;
+	}
+
+	size_t size = SHYPNM_FormatRowSize(format, hdr.w);
+	void * pix  = SHYPNM_MALLOC(size * hdr.h);
+	if (!pix) {
+		perror(strerror(errno));
+	}
+	if (pix && !SHYPNM_DecodeInto(&rd, pix, size, format)) {
+		SHYPNM_FREE(pix);
+		pix = NULL;
+	}
+
+	SHYPNM_CloseRows(&rd);
+	SHYPNM_CloseSource(source, &src);
+	*w = pix ? hdr.w : -1;
+	*h = pix ? hdr.h : -1;
+	return pix;
+}
+
+int PnmLoadInto(const PnmSource *source,
+                void *           dst,
+                size_t           stride,
+                int              format,
+                int *            w,
+                int *            h)
+{
+	int maxw = *w;
+	int maxh = *h;
+
+	*w = -1;
+	*h = -1;
+	if (format < PNM_RGBA32 || format > PNM_BIT1) {
+		fprintf(stderr, "Error loading Pnm file; unknown format.\n");
+		return 0;
+	}
+
+	SHYPNM_Source src;
+	const char *  name;
+	if (!SHYPNM_OpenSource(source, &src, &name)) {
+		return 0;
+	}
+
+	SHYPNM_Header    hdr;
+	SHYPNM_RowReader rd;
+	if (!SHYPNM_ParseHeader(&src, name, &hdr)) {
+		SHYPNM_CloseSource(source, &src);
+		return 0;
+	}
+
+	size_t size = SHYPNM_FormatRowSize(format, hdr.w);
+	if (stride == 0) {
+		stride = size;
+	}
+	if (hdr.w > maxw || hdr.h > maxh || stride < size) {
+		fprintf(stderr,
+		        "Error loading Pnm file; %dx%d image does not fit the "
+		        "destination.\n",
+		        hdr.w,
+		        hdr.h);
+		SHYPNM_CloseSource(source, &src);
+		return 0;
+	}
+
+	bool ok = SHYPNM_OpenRows(&rd, &src, &hdr);
+	if (ok) {
+		ok = SHYPNM_DecodeInto(&rd, dst, stride, format);
+		SHYPNM_CloseRows(&rd);
+	}
+
+	SHYPNM_CloseSource(source, &src);
+	*w = ok ? hdr.w : -1;
+	*h = ok ? hdr.h : -1;
+	return ok;
+}
+
+int PnmStreamRows(const PnmSource *source, PnmRowCallback callback, void *user)
+{
+	SHYPNM_Source src;
+	const char *  name;
+	if (!SHYPNM_OpenSource(source, &src, &name)) {
+		return 0;
+	}
+
+	SHYPNM_Header    hdr;
+	SHYPNM_RowReader rd;
+	if (!SHYPNM_ParseHeader(&src, name, &hdr)
+	    || !SHYPNM_OpenRows(&rd, &src, &hdr)) {
+		SHYPNM_CloseSource(source, &src);
+		return 0;
+	}
+
+	size_t batch = SHYPNM_STREAMBATCH / (hdr.w * sizeof(uint32_t));
+	if (batch < 1) {
+		batch = 1;
+	} else if (batch > (size_t)hdr.h) {
+		batch = hdr.h;
+	}
+
+	uint32_t *pix = SHYPNM_AllocPixels(hdr.w, batch);
+	bool      ok  = pix != NULL;
+	for (int y = 0; ok && y < hdr.h; y += batch) {
+		int rows = hdr.h - y < (int)batch ? hdr.h - y : (int)batch;
+
+		ok = SHYPNM_ReadRows(&rd, pix, rows)
+		     && callback(user, pix, hdr.w, hdr.h, y, rows);
+	}
+
+	SHYPNM_FREE(pix);
+	SHYPNM_CloseRows(&rd);
+	SHYPNM_CloseSource(source, &src);
+	return ok;
+}
+
+// A push decoder reads the header one character at a time, keeping the
+// partial token and the fields seen so far between calls, so that its input
+// may be split anywhere. Binary rows are decoded straight from the input when
+// a whole row is available, and are otherwise collected in a row buffer first.
+// Plain samples are accumulated digit by digit.
+enum SHYPNM_DecoderState {
+	SHYPNM_DECMAGIC,
+	SHYPNM_DECHEADER,
+	SHYPNM_DECLINE,
+	SHYPNM_DECRASTER,
+	SHYPNM_DECDONE,
+	SHYPNM_DECERROR
+};
+
+#define SHYPNM_TOKENMAX 16
+
+struct PnmDecoder {
+	int              state;
+	int              after;
+	SHYPNM_Header    hdr;
+	int              field;
+	char             token[SHYPNM_TOKENMAX + 1];
+	int              toklen;
+	SHYPNM_Source    src;
+	SHYPNM_RowReader rd;
+	uint8_t *        row;
+	size_t           fill;
+	bool             comment;
+	bool             digits;
+	uint32_t         value;
+	uint32_t *       pix;
+	size_t           cap;
+	int              y;
+};
+
+PnmDecoder *PnmDecoderCreate(void)
+{
+	PnmDecoder *dec = SHYPNM_CALLOC(1, sizeof(PnmDecoder));
+	if (!dec) {
+		perror(strerror(errno));
+		return NULL;
+	}
+
+	dec->state = SHYPNM_DECMAGIC;
+	dec->src   = SHYPNM_MemorySource(NULL, 0);
+	return dec;
+}
+
+bool SHYPNM_DecoderToken(PnmDecoder *dec, int *next)
+{
+	// Handles a complete header token. PAM headers alternate between
+	// keywords and values; field is the value the next token holds, or 0
+	// if it is a keyword. Sets *next to SHYPNM_DECLINE if the rest of the
+	// line is to be skipped, and to SHYPNM_DECRASTER after the last field.
+	static const char *keys[] = {"", "WIDTH", "HEIGHT", "DEPTH", "MAXVAL"};
+	static const int   order[] = {1, 2, 4};
+
+	int *fields[] = {NULL,
+	                 &dec->hdr.w,
+	                 &dec->hdr.h,
+	                 &dec->hdr.depth,
+	                 &dec->hdr.maxval};
+	int  len      = dec->toklen;
+	bool pam      = dec->hdr.magic == '7';
+
+	*next = SHYPNM_DECHEADER;
+	if (len > SHYPNM_TOKENMAX) {
+		len = SHYPNM_TOKENMAX;
+	}
+	dec->token[len] = '\0';
+
+	if (pam && dec->field == 0) {
+		for (int i = 1; i < 5; i++) {
+			if (!strcmp(dec->token, keys[i])) {
+				dec->field = i;
+				return true;
+			}
+		}
+		*next = strcmp(dec->token, "ENDHDR") ? SHYPNM_DECLINE
+		                                      : SHYPNM_DECRASTER;
+		return true;
+	}
+
+	// Values too long to fit in an int are clamped, and fail the checks
+	// made once the header is complete.
+	int n = 0;
+	for (int i = 0; i < len; i++) {
+		if (dec->token[i] < '0' || dec->token[i] > '9') {
+			fprintf(stderr,
+			        "Error reading Pnm file; invalid character "
+			        "encountered in integer.\n");
+			return false;
+		}
+		n = n * 10 + (dec->token[i] - '0');
+	}
+	if (dec->toklen > 9) {
+		n = INT32_MAX;
+	}
+
+	if (pam) {
+		*fields[dec->field] = n;
+		dec->field          = 0;
+	} else {
+		*fields[order[dec->field]] = n;
+		dec->field++;
+		bool pbm = dec->hdr.magic == '1' || dec->hdr.magic == '4';
+		if (dec->field == (pbm ? 2 : 3)) {
+			*next = SHYPNM_DECRASTER;
+		}
+	}
+
+	return true;
+}
+
+bool SHYPNM_DecoderStart(PnmDecoder *dec)
+{
+	// Checks the complete header and sets up decoding of the raster.
+	SHYPNM_Header *hdr = &dec->hdr;
+
+	if (hdr->depth < 1 || hdr->depth > 4) {
+		fprintf(stderr,
+		        "Error reading Pnm file; depth must be between 1-4.\n");
+		return false;
+	}
+	if (hdr->maxval < 1 || hdr->maxval > UINT16_MAX) {
+		fprintf(
+		    stderr,
+		    "Error reading Pnm file; maxval must be between 1-%u.\n",
+		    UINT16_MAX);
+		return false;
+	}
+	if (hdr->w < 1 || hdr->h < 1) {
+		fprintf(stderr,
+		        "Error reading Pnm file; width and height must be at "
+		        "least 1.\n");
+		return false;
+	}
+
+	// Streams keep the pixels of the last image, which are reused if
+	// they are large enough.
+	if (dec->cap < (size_t)hdr->w * hdr->h) {
+		SHYPNM_FREE(dec->pix);
+		dec->pix = SHYPNM_AllocPixels(hdr->w, hdr->h);
+		dec->cap = (size_t)hdr->w * hdr->h;
+	}
+	if (!dec->pix || !SHYPNM_OpenRows(&dec->rd, &dec->src, hdr)) {
+		SHYPNM_FREE(dec->pix);
+		dec->pix = NULL;
+		dec->cap = 0;
+		return false;
+	}
+	if (hdr->magic >= '4') {
+		dec->row = SHYPNM_MALLOC(dec->rd.rowsize);
+		if (!dec->row) {
+			perror(strerror(errno));
+			return false;
+		}
+	}
+
+	dec->comment = false;
+	dec->state   = SHYPNM_DECRASTER;
+	return true;
+}
+
+bool SHYPNM_DecoderHeader(PnmDecoder *dec, int c)
+{
+	// Handles one character of the magic number or header.
+	if (dec->state == SHYPNM_DECMAGIC) {
+		if (dec->toklen == 0 && c == 'P') {
+			dec->toklen = 1;
+			return true;
+		} else if (dec->toklen == 0 || c < '1' || c > '7') {
+			fprintf(stderr,
+			        "Data is not a valid pnm file. Invalid magic "
+			        "number encountered.\n");
+			return false;
+		}
+
+		dec->hdr    = (SHYPNM_Header){.magic = c};
+		dec->state  = SHYPNM_DECHEADER;
+		dec->toklen = 0;
+		if (c != '7') {
+			// Only PAM headers give the depth, and PBM headers
+			// have no maxval.
+			dec->hdr.depth  = c == '3' || c == '6' ? 3 : 1;
+			dec->hdr.maxval = 1;
+		}
+		return true;
+	} else if (dec->state == SHYPNM_DECLINE) {
+		if (c != '\n') {
+			return true;
+		} else if (dec->after == SHYPNM_DECRASTER) {
+			return SHYPNM_DecoderStart(dec);
+		}
+		dec->state = SHYPNM_DECHEADER;
+		return true;
+	}
+
+	if (!isspace(c) && c != '#') {
+		if (dec->toklen < SHYPNM_TOKENMAX) {
+			dec->token[dec->toklen] = c;
+		}
+		dec->toklen++;
+		return true;
+	}
+
+	int next = SHYPNM_DECHEADER;
+	if (dec->toklen > 0 && !SHYPNM_DecoderToken(dec, &next)) {
+		return false;
+	}
+	dec->toklen = 0;
+
+	// Comments run to the end of the line, as do PAM header lines after
+	// any keyword other than WIDTH, HEIGHT, DEPTH or MAXVAL.
+	dec->after = next == SHYPNM_DECRASTER ? next : SHYPNM_DECHEADER;
+	if (c == '#'
+	    || (dec->hdr.magic == '7' && next != SHYPNM_DECHEADER
+	        && c != '\n')) {
+		dec->state = SHYPNM_DECLINE;
+	} else if (next == SHYPNM_DECRASTER) {
+		return SHYPNM_DecoderStart(dec);
+	}
+
+	return true;
+}
+
+bool SHYPNM_DecoderSample(PnmDecoder *dec)
+{
+	// Stores a complete plain sample, packing the row once it is full.
+	SHYPNM_RowReader *rd = &dec->rd;
+
+	if (dec->value > (uint32_t)rd->lut->maxval) {
+		fprintf(stderr,
+		        "Error reading Pnm file; pixel value greater than "
+		        "maxval encountered.\n");
+		return false;
+	}
+	rd->samples[dec->fill++] = rd->lut->table[dec->value];
+	dec->value               = 0;
+	dec->digits              = false;
+
+	if (dec->fill == (size_t)dec->hdr.w * dec->hdr.depth) {
+		uint32_t *row = dec->pix + (size_t)dec->y * dec->hdr.w;
+		int       w   = dec->hdr.w;
+		if (dec->hdr.depth == 1) {
+			SHYPNM_GrayscaleRow8(rd->samples, row, w, false);
+		} else {
+			SHYPNM_ColorRow8(rd->samples, row, w, false);
+		}
+		dec->fill = 0;
+		dec->y++;
+	}
+
+	return true;
+}
+
+size_t SHYPNM_DecoderText(PnmDecoder *dec, const uint8_t *p, size_t n)
+{
+	// Plain PBM samples are single characters, while plain PGM and PPM
+	// samples end at the first whitespace or comment after their digits.
+	size_t used = 0;
+
+	for (; used < n && dec->y < dec->hdr.h; used++) {
+		int c = p[used];
+
+		if (dec->comment) {
+			dec->comment = c != '\n';
+		} else if (dec->hdr.magic == '1') {
+			size_t   x = (size_t)dec->y * dec->hdr.w + dec->fill;
+			uint32_t v = c == '1' ? 0x000000ff : 0xffffffff;
+			if (c == '0' || c == '1') {
+				dec->pix[x] = v;
+				if (++dec->fill == (size_t)dec->hdr.w) {
+					dec->fill = 0;
+					dec->y++;
+				}
+			}
+			dec->comment = c == '#';
+		} else if (c >= '0' && c <= '9') {
+			if (dec->value <= UINT16_MAX) {
+				dec->value = dec->value * 10 + (c - '0');
+			}
+			dec->digits = true;
+		} else if (!isspace(c) && c != '#') {
+			fprintf(stderr,
+			        "Error reading Pnm file; invalid character "
+			        "encountered in integer.\n");
+			dec->state = SHYPNM_DECERROR;
+			return used;
+		} else {
+			dec->comment = c == '#';
+			if (dec->digits && !SHYPNM_DecoderSample(dec)) {
+				dec->state = SHYPNM_DECERROR;
+				return used;
+			}
+		}
+	}
+
+	return used;
+}
+
+size_t SHYPNM_DecoderRaster(PnmDecoder *dec, const uint8_t *p, size_t n)
+{
+	// Decodes as much of the raster as p holds, and returns the number of
+	// bytes used.
+	SHYPNM_RowReader *rd   = &dec->rd;
+	size_t            used = 0;
+
+	if (dec->hdr.magic <= '3') {
+		used = SHYPNM_DecoderText(dec, p, n);
+	}
+
+	while (dec->hdr.magic >= '4' && dec->y < dec->hdr.h && used < n) {
+		const uint8_t *row = p + used;
+
+		if (dec->fill == 0 && n - used >= rd->rowsize) {
+			used += rd->rowsize;
+		} else {
+			size_t k = rd->rowsize - dec->fill;
+			if (k > n - used) {
+				k = n - used;
+			}
+			memcpy(dec->row + dec->fill, p + used, k);
+			dec->fill += k;
+			used += k;
+			if (dec->fill < rd->rowsize) {
+				break;
+			}
+			dec->fill = 0;
+			row       = dec->row;
+		}
+
+		if (!SHYPNM_DecodeRow(row,
+		                      rd->samples,
+		                      dec->pix + (size_t)dec->y * dec->hdr.w,
+		                      dec->hdr.w,
+		                      rd->depth,
+		                      &rd->scale)) {
+			dec->state = SHYPNM_DECERROR;
+			return used;
+		}
+		dec->y++;
+	}
+
+	if (dec->state == SHYPNM_DECRASTER && dec->y == dec->hdr.h) {
+		dec->state = SHYPNM_DECDONE;
+	}
+	return used;
+}
+
+ptrdiff_t PnmDecoderFeed(PnmDecoder *dec, const void *buf, size_t len)
+{
+	const uint8_t *p    = buf;
+	size_t         used = 0;
+
+	SHYPNM_STATMAX(threads, 1);
+	if (dec->state < SHYPNM_DECRASTER) {
+		SHYPNM_STATENTER(SHYPNM_PHASEHEADER);
+		while (used < len && dec->state < SHYPNM_DECRASTER) {
+			if (!SHYPNM_DecoderHeader(dec, p[used++])) {
+				dec->state = SHYPNM_DECERROR;
+			}
+		}
+		SHYPNM_STATLEAVE();
+	}
+	if (dec->state == SHYPNM_DECRASTER) {
+		SHYPNM_STATENTER(SHYPNM_PHASEDECODE);
+		used += SHYPNM_DecoderRaster(dec, p + used, len - used);
+		SHYPNM_STATLEAVE();
+	}
+
+	return dec->state == SHYPNM_DECERROR ? -1 : (ptrdiff_t)used;
+}
+
+int PnmDecoderRowsReady(const PnmDecoder *dec)
+{
+	return dec->pix ? dec->y : 0;
+}
+
+const uint32_t *PnmDecoderPixels(const PnmDecoder *dec, int *w, int *h)
+{
+	*w = dec->pix ? dec->hdr.w : -1;
+	*h = dec->pix ? dec->hdr.h : -1;
+	return dec->pix;
+}
+
+bool SHYPNM_DecoderEnd(PnmDecoder *dec)
+{
+	// Ends the image once no more data is coming, and releases everything
+	// but the pixels. Returns true if the image is complete.
+	//
+	// A plain sample at the very end of the data has no terminator, so it
+	// is only complete once no more data is coming.
+	if (dec->state == SHYPNM_DECRASTER && dec->digits
+	    && SHYPNM_DecoderSample(dec) && dec->y == dec->hdr.h) {
+		dec->state = SHYPNM_DECDONE;
+	}
+
+	if (dec->state != SHYPNM_DECDONE && dec->state != SHYPNM_DECERROR) {
+		fprintf(stderr,
+		        "Error reading Pnm file; unexpected end-of-file "
+		        "reached while reading pixel data.\n");
+	}
+	if (dec->state >= SHYPNM_DECRASTER && dec->pix) {
+		SHYPNM_CloseRows(&dec->rd);
+		memset(&dec->rd, 0, sizeof(dec->rd));
+	}
+
+	SHYPNM_FREE(dec->row);
+	dec->row = NULL;
+	return dec->state == SHYPNM_DECDONE;
+}
+
+uint32_t *PnmDecoderFinish(PnmDecoder *dec, int *w, int *h)
+{
+	uint32_t *pix = dec->pix;
+	if (!SHYPNM_DecoderEnd(dec)) {
+		SHYPNM_FREE(pix);
+		pix = NULL;
+	}
+
+	*w = pix ? dec->hdr.w : -1;
+	*h = pix ? dec->hdr.h : -1;
+	SHYPNM_FREE(dec);
+	return pix;
+}
+
+// Streams decode one image after another from a source with a push decoder,
+// which never seeks, so pipes can be read as well as files. Files are never
+// read past the end of the current image, so each image of a pipe is returned
+// as soon as it has arrived, and data after the last image is left unread.
+#define SHYPNM_READBLOCK (1 << 20)
+
+struct PnmStream {
+	PnmSource     source;
+	SHYPNM_Source src;
+	uint8_t *     buf;
+	PnmDecoder    dec;
+};
+
+PnmStream *PnmStreamOpen(const PnmSource *source)
+{
+	PnmStream * stream = SHYPNM_CALLOC(1, sizeof(PnmStream));
+	const char *name;
+
+	if (!stream) {
+		perror(strerror(errno));
+		return NULL;
+	} else if (!SHYPNM_OpenSource(source, &stream->src, &name)) {
+		SHYPNM_FREE(stream);
+		return NULL;
+	}
+
+	stream->source = *source;
+	if (stream->src.f) {
+		stream->buf = SHYPNM_MALLOC(SHYPNM_READBLOCK);
+		if (!stream->buf) {
+			perror(strerror(errno));
+			PnmStreamClose(stream);
+			return NULL;
+		}
+	}
+	return stream;
+}
+
+size_t SHYPNM_StreamWant(const PnmDecoder *dec)
+{
+	// Gives a number of bytes which the image is sure to still need. Each
+	// plain sample but the last is followed by at least one separator.
+	size_t left, want;
+
+	if (dec->state != SHYPNM_DECRASTER) {
+		return 1;
+	}
+
+	switch (dec->hdr.magic) {
+	case '1':
+		want = (size_t)(dec->hdr.h - dec->y) * dec->hdr.w - dec->fill;
+		break;
+	case '2':
+	case '3':
+		left = (size_t)(dec->hdr.h - dec->y) * dec->hdr.w
+		       * dec->hdr.depth;
+		left -= dec->fill;
+		want = dec->digits ? 2 * (left - 1) : 2 * left - 1;
+		break;
+	default:
+		want = (size_t)(dec->hdr.h - dec->y) * dec->rd.rowsize;
+		want -= dec->fill;
+		break;
+	}
+
+	return want ? want : 1;
+}
+
+const uint32_t *PnmStreamNext(PnmStream *stream, int *w, int *h)
+{
+	PnmDecoder *   dec = &stream->dec;
+	SHYPNM_Source *src = &stream->src;
+	int            c;
+
+	*w = -1;
+	*h = -1;
+
+	// The decoder starts afresh for every image, keeping only its pixels.
+	*dec = (PnmDecoder){.state = SHYPNM_DECMAGIC,
+	                    .src   = SHYPNM_MemorySource(NULL, 0),
+	                    .pix   = dec->pix,
+	                    .cap   = dec->cap};
+
+	// Whitespace and comments between images are skipped, and the stream
+	// ends if there is nothing else.
+	do {
+		c = SHYPNM_Getc(src);
+		while (c == '#') {
+			do {
+				c = SHYPNM_Getc(src);
+			} while (c != -1 && c != '\n');
+		}
+	} while (c != -1 && isspace(c));
+	if (c == -1) {
+		*w = 0;
+		*h = 0;
+		return NULL;
+	}
+
+	uint8_t first = c;
+	PnmDecoderFeed(dec, &first, 1);
+
+	while (dec->state < SHYPNM_DECDONE) {
+		const uint8_t *p = src->data + src->pos;
+		size_t         n = src->size - src->pos;
+
+		if (src->f) {
+			n = SHYPNM_StreamWant(dec);
+			if (n > SHYPNM_READBLOCK) {
+				n = SHYPNM_READBLOCK;
+			}
+			p = stream->buf;
+			n = fread(stream->buf, 1, n, src->f);
+			SHYPNM_STATADD(io_calls, 1);
+			SHYPNM_STATADD(bytes_read, n);
+		}
+		if (n == 0) {
+			break;
+		}
+
+		ptrdiff_t used = PnmDecoderFeed(dec, p, n);
+		if (used >= 0 && !src->f) {
+			src->pos += used;
+		}
+	}
+
+	if (!SHYPNM_DecoderEnd(dec)) {
+		return NULL;
+	}
+	*w = dec->hdr.w;
+	*h = dec->hdr.h;
+	return dec->pix;
+}
+
+void PnmStreamClose(PnmStream *stream)
+{
+	if (!stream) {
+		return;
+	}
+
+	SHYPNM_CloseSource(&stream->source, &stream->src);
+	SHYPNM_FREE(stream->dec.pix);
+	SHYPNM_FREE(stream->buf);
+	SHYPNM_FREE(stream);
+}
+
+// Images are written through a writer, which gathers the output in a buffer.
+// Files are written a block at a time, while memory output is kept whole in
+// a buffer which grows as needed.
+#define SHYPNM_WRITEBLOCK (1 << 20)
+#define SHYPNM_HEADERMAX  (128 + SHYPNM_TUPLTYPEMAX)
+#define SHYPNM_LINEMAX    70
+
+typedef struct {
+	FILE *      f;
+	uint8_t *   buf;
+	size_t      used;
+	size_t      cap;
+	int         format;
+	int         channels;
+	int         magic;
+	int         w;
+	int         h;
+	int         depth;
+	int         maxval;
+	int         digits;
+	const char *tupltype;
+	uint16_t *  scale;
+	uint8_t *   text;
+	uint8_t *   narrow;
+	uint16_t *  wide;
+	uint8_t *   temp;
+} SHYPNM_Writer;
+
+bool SHYPNM_WriteFlush(SHYPNM_Writer *wr)
+{
+	if (wr->f && wr->used) {
+		if (fwrite(wr->buf, 1, wr->used, wr->f) != wr->used) {
+			fprintf(stderr, "Error writing Pnm file; %s.\n",
+			        strerror(errno));
+			return false;
+		}
+		wr->used = 0;
+	}
+	return true;
+}
+
+uint8_t *SHYPNM_WriteReserve(SHYPNM_Writer *wr, size_t n)
+{
+	// Returns room for n more bytes at the end of the buffer, flushing it
+	// to the file or growing it first if needed.
+	if (wr->cap - wr->used >= n) {
+		return wr->buf + wr->used;
+	} else if (wr->f && !SHYPNM_WriteFlush(wr)) {
+		return NULL;
+	}
+
+	if (wr->cap - wr->used < n) {
+		size_t cap = wr->cap * 2 > wr->used + n ? wr->cap * 2
+		                                        : wr->used + n;
+		uint8_t *buf = SHYPNM_REALLOC(wr->buf, wr->used, cap);
+		if (!buf) {
+			perror(strerror(errno));
+			return NULL;
+		}
+		wr->buf = buf;
+		wr->cap = cap;
+	}
+	return wr->buf + wr->used;
+}
+
+bool SHYPNM_WriteHeader(SHYPNM_Writer *wr)
+{
+	uint8_t *out = SHYPNM_WriteReserve(wr, SHYPNM_HEADERMAX);
+	if (!out) {
+		return false;
+	}
+
+	int n;
+	switch (wr->magic) {
+	case '1':
+	case '4':
+		n = sprintf(
+		    (char *)out, "P%c\n%d %d\n", wr->magic, wr->w, wr->h);
+		break;
+	case '7':
+		n = sprintf((char *)out,
+		            "P7\nWIDTH %d\nHEIGHT %d\nDEPTH %d\nMAXVAL %d\n"
+		            "TUPLTYPE %.*s\nENDHDR\n",
+		            wr->w,
+		            wr->h,
+		            wr->depth,
+		            wr->maxval,
+		            SHYPNM_TUPLTYPEMAX - 1,
+		            wr->tupltype);
+		break;
+	default:
+		n = sprintf((char *)out,
+		            "P%c\n%d %d\n%d\n",
+		            wr->magic,
+		            wr->w,
+		            wr->h,
+		            wr->maxval);
+		break;
+	}
+
+	wr->used += n;
+	return true;
+}
+
+#ifdef SHYPNM_HAVE_X86_SIMD
+
+// These kernels undo the byte shuffles of the load kernels, and like them
+// return the number of pixels or samples converted.
+
+__attribute__((target("ssse3"))) int SHYPNM_SplitRow8Ssse3(
+    const uint32_t *pix, uint8_t *dest, int w, bool put_alpha)
+{
+	int x = 0;
+
+	if (put_alpha) {
+		const __m128i shuf = _mm_setr_epi8(
+		    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+		for (; x + 4 <= w; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(pix + x));
+			_mm_storeu_si128((__m128i *)(dest + x * 4),
+			                 _mm_shuffle_epi8(v, shuf));
+		}
+	} else {
+		const __m128i shuf = _mm_setr_epi8(
+		    3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+		for (; x + 6 <= w; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(pix + x));
+			_mm_storeu_si128((__m128i *)(dest + x * 3),
+			                 _mm_shuffle_epi8(v, shuf));
+		}
+	}
+
+	return x;
+}
+
+__attribute__((target("avx2"))) int SHYPNM_SplitRow8Avx2(
+    const uint32_t *pix, uint8_t *dest, int w, bool put_alpha)
+{
+	int x = 0;
+
+	if (put_alpha) {
+		const __m256i shuf = _mm256_setr_epi8(
+		    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+		    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+		for (; x + 8 <= w; x += 8) {
+			__m256i v
+			    = _mm256_loadu_si256((const __m256i *)(pix + x));
+			_mm256_storeu_si256((__m256i *)(dest + x * 4),
+			                    _mm256_shuffle_epi8(v, shuf));
+		}
+	} else {
+		// Each lane packs its four triples into its low 12 bytes,
+		// which are then gathered into the low 24 bytes.
+		const __m256i shuf = _mm256_setr_epi8(
+		    3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1,
+		    3, 2, 1, 7, 6, 5, 11, 10, 9, 15, 14, 13, -1, -1, -1, -1);
+		const __m256i gather
+		    = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+		for (; x + 11 <= w; x += 8) {
+			__m256i v
+			    = _mm256_loadu_si256((const __m256i *)(pix + x));
+			v = _mm256_shuffle_epi8(v, shuf);
+			v = _mm256_permutevar8x32_epi32(v, gather);
+			_mm256_storeu_si256((__m256i *)(dest + x * 3), v);
+		}
+	}
+
+	return x;
+}
+
+__attribute__((target("ssse3"))) size_t
+SHYPNM_SwapRow16Ssse3(const uint16_t *s, uint8_t *dest, size_t n)
+{
+	const __m128i shuf = _mm_setr_epi8(
+	    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		_mm_storeu_si128((__m128i *)(dest + i * 2),
+		                 _mm_shuffle_epi8(v, shuf));
+	}
+
+	return i;
+}
+
+__attribute__((target("avx2"))) size_t
+SHYPNM_SwapRow16Avx2(const uint16_t *s, uint8_t *dest, size_t n)
+{
+	const __m256i shuf = _mm256_setr_epi8(
+	    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	size_t i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		_mm256_storeu_si256((__m256i *)(dest + i * 2),
+		                    _mm256_shuffle_epi8(v, shuf));
+	}
+
+	return i;
+}
+
+#endif
+
+void SHYPNM_SplitRow8(const uint32_t *pix, uint8_t *dest, int w, bool put_alpha)
+{
+	// Unpacks RGBA words into RGB or RGBA bytes.
+	int x = 0;
+
+#ifdef SHYPNM_HAVE_X86_SIMD
+	switch (SHYPNM_SimdLevel()) {
+	case SHYPNM_SIMDAVX2:
+		x = SHYPNM_SplitRow8Avx2(pix, dest, w, put_alpha);
+		break;
+	case SHYPNM_SIMDSSSE3:
+		x = SHYPNM_SplitRow8Ssse3(pix, dest, w, put_alpha);
+		break;
+	default:
+		break;
+	}
+#endif
+
+	int step = put_alpha ? 4 : 3;
+	for (; x < w; x++) {
+		dest[x * step]     = pix[x] >> 24;
+		dest[x * step + 1] = pix[x] >> 16;
+		dest[x * step + 2] = pix[x] >> 8;
+		if (put_alpha) {
+			dest[x * 4 + 3] = pix[x];
+		}
+	}
+}
+
+void SHYPNM_SwapRow16(const uint16_t *s, uint8_t *dest, size_t n)
+{
+	// Stores n samples as big-endian 16-bit values.
+	size_t i = 0;
+
+#ifdef SHYPNM_HAVE_X86_SIMD
+	switch (SHYPNM_SimdLevel()) {
+	case SHYPNM_SIMDAVX2:
+		i = SHYPNM_SwapRow16Avx2(s, dest, n);
+		break;
+	case SHYPNM_SIMDSSSE3:
+		i = SHYPNM_SwapRow16Ssse3(s, dest, n);
+		break;
+	default:
+		break;
+	}
+#endif
+
+	for (; i < n; i++) {
+		dest[i * 2]     = s[i] >> 8;
+		dest[i * 2 + 1] = s[i];
+	}
+}
+
+// Samples are rescaled to maxval rounding up, which exactly undoes the
+// rounding down of loading, so an image loaded and saved with the same
+// maxval is unchanged.
+#define SHYPNM_RESCALE(v, from, to)                                            \
+	(((uint32_t)(v) * (to) + (from) - 1) / (from))
+
+const uint8_t *
+SHYPNM_SaveNarrow(SHYPNM_Writer *wr, const void *row, uint8_t *dest)
+{
+	// Returns a row of 8-bit samples with the depth of the image, which is
+	// either row itself or converted into dest.
+	const uint8_t *s = row;
+	int            w = wr->w;
+
+	if (wr->format == PNM_RGBA32) {
+		if (wr->depth >= 3) {
+			SHYPNM_SplitRow8(row, dest, w, wr->depth == 4);
+			return dest;
+		}
+		SHYPNM_SplitRow8(row, wr->temp, w, true);
+		s = wr->temp;
+	} else if (wr->format == PNM_BIT1) {
+		for (int x = 0; x < w; x++) {
+			bool ink    = (s[x / 8] >> (7 - x % 8)) & 1;
+			wr->temp[x] = ink ? 0 : UINT8_MAX;
+		}
+		s = wr->temp;
+	}
+
+	if (wr->channels == wr->depth) {
+		return s;
+	}
+	SHYPNM_PackRow8(s, wr->channels, dest, wr->depth, w);
+	return dest;
+}
+
+const uint16_t *SHYPNM_SaveWide(SHYPNM_Writer *wr, const void *row)
+{
+	// Returns a row of 16-bit samples with the depth of the image.
+	if (wr->channels == wr->depth) {
+		return row;
+	}
+	SHYPNM_PackRow16(row, wr->channels, wr->wide, wr->depth, wr->w);
+	return wr->wide;
+}
+
+bool SHYPNM_SaveBitmapRow(SHYPNM_Writer *wr, const void *row)
+{
+	// Marks pixels darker than half intensity as black, as when bitmaps
+	// are loaded with PnmLoadEx().
+	const uint8_t *bits = row;
+	int            w    = wr->w;
+	size_t         n    = (size_t)w + w / SHYPNM_LINEMAX + 1;
+	uint8_t *      ink  = wr->temp;
+	uint8_t *      out;
+
+	if (wr->magic == '4') {
+		n = ((size_t)w + 7) / 8;
+	}
+	out = SHYPNM_WriteReserve(wr, n);
+
+	if (!out) {
+		return false;
+	} else if (wr->format == PNM_BIT1 && wr->magic == '4') {
+		memcpy(out, row, n);
+		wr->used += n;
+		return true;
+	}
+
+	if (wr->format == PNM_BIT1) {
+		for (int x = 0; x < w; x++) {
+			ink[x] = (bits[x / 8] >> (7 - x % 8)) & 1;
+		}
+	} else if (SHYPNM_FormatWide(wr->format)) {
+		const uint16_t *s = SHYPNM_SaveWide(wr, row);
+		for (int x = 0; x < w; x++) {
+			ink[x] = s[x] < 0x8000;
+		}
+	} else {
+		const uint8_t *s = SHYPNM_SaveNarrow(wr, row, wr->narrow);
+		for (int x = 0; x < w; x++) {
+			ink[x] = s[x] < 0x80;
+		}
+	}
+
+	if (wr->magic == '4') {
+		for (int x = 0; x < w; x += 8) {
+			uint8_t bits = 0;
+			for (int i = 0; i < 8 && x + i < w; i++) {
+				bits |= ink[x + i] << (7 - i);
+			}
+			*out++ = bits;
+		}
+	} else {
+		for (int x = 0; x < w; x++) {
+			if (x && x % SHYPNM_LINEMAX == 0) {
+				*out++ = '\n';
+			}
+			*out++ = '0' + ink[x];
+		}
+		*out++ = '\n';
+	}
+
+	wr->used = out - wr->buf;
+	return true;
+}
+
+size_t SHYPNM_TextRowSize(const SHYPNM_Writer *wr)
+{
+	// A plain sample takes at most one separator and the digits of maxval.
+	return (size_t)wr->w * wr->depth * (wr->digits + 1) + 8;
+}
+
+bool SHYPNM_SaveRasterRow(SHYPNM_Writer *wr, const void *row)
+{
+	const uint16_t *scale = wr->scale;
+	size_t          n     = (size_t)wr->w * wr->depth;
+	bool            wide  = wr->maxval > UINT8_MAX;
+	uint8_t *       out   = SHYPNM_WriteReserve(wr, wide ? n * 2 : n);
+
+	if (!out) {
+		return false;
+	} else if (SHYPNM_FormatWide(wr->format)) {
+		const uint16_t *s = SHYPNM_SaveWide(wr, row);
+		if (!scale) {
+			SHYPNM_SwapRow16(s, out, n);
+		} else if (wide) {
+			for (size_t i = 0; i < n; i++) {
+				out[i * 2]     = scale[s[i]] >> 8;
+				out[i * 2 + 1] = scale[s[i]];
+			}
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				out[i] = scale[s[i]];
+			}
+		}
+	} else if (!scale) {
+		const uint8_t *s = SHYPNM_SaveNarrow(wr, row, out);
+		if (s != out) {
+			memcpy(out, s, n);
+		}
+	} else {
+		const uint8_t *s = SHYPNM_SaveNarrow(wr, row, wr->narrow);
+		if (wide) {
+			for (size_t i = 0; i < n; i++) {
+				out[i * 2]     = scale[s[i]] >> 8;
+				out[i * 2 + 1] = scale[s[i]];
+			}
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				out[i] = scale[s[i]];
+			}
+		}
+	}
+
+	wr->used += wide ? n * 2 : n;
+	return true;
+}
+
+bool SHYPNM_SaveTextRow(SHYPNM_Writer *wr, const void *row)
+{
+	// Each row starts a new line, and long rows are broken into lines of
+	// at most 70 characters. Digits are copied five at a time from the
+	// text table, so a few bytes of slack are reserved past the row.
+	size_t          n      = (size_t)wr->w * wr->depth;
+	size_t          size   = SHYPNM_TextRowSize(wr);
+	const uint8_t * narrow = NULL;
+	const uint16_t *wide   = NULL;
+	int             col    = 0;
+	uint8_t *       out    = SHYPNM_WriteReserve(wr, size);
+
+	if (!out) {
+		return false;
+	} else if (SHYPNM_FormatWide(wr->format)) {
+		wide = SHYPNM_SaveWide(wr, row);
+	} else {
+		narrow = SHYPNM_SaveNarrow(wr, row, wr->narrow);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		uint32_t v = wide ? wide[i] : narrow[i];
+		if (wr->scale) {
+			v = wr->scale[v];
+		}
+
+		const uint8_t *digits = wr->text + v * 8;
+		if (col + digits[0] + 1 > SHYPNM_LINEMAX) {
+			*out++ = '\n';
+			col    = 0;
+		} else if (col) {
+			*out++ = ' ';
+			col++;
+		}
+		memcpy(out, digits + 1, 5);
+		out += digits[0];
+		col += digits[0];
+	}
+	*out++ = '\n';
+
+	wr->used = out - wr->buf;
+	return true;
+}
+
+bool SHYPNM_SaveRows(SHYPNM_Writer *wr, const void *pix, size_t stride)
+{
+	for (int y = 0; y < wr->h; y++) {
+		const uint8_t *row = (const uint8_t *)pix + y * stride;
+		bool           ok;
+
+		switch (wr->magic) {
+		case '1':
+		case '4':
+			ok = SHYPNM_SaveBitmapRow(wr, row);
+			break;
+		case '2':
+		case '3':
+			ok = SHYPNM_SaveTextRow(wr, row);
+			break;
+		default:
+			ok = SHYPNM_SaveRasterRow(wr, row);
+			break;
+		}
+		if (!ok) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SHYPNM_OpenWriter(SHYPNM_Writer *wr, const PnmInfo *info, int format)
+{
+	// Checks the description of the image and allocates the writer's
+	// buffers. A zero depth or maxval is taken from the pixel format, and
+	// an empty tuple type from the depth.
+	static const char *tupltypes[]
+	    = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+
+	*wr = (SHYPNM_Writer){.format = format};
+
+	if (!info || info->magic < '1' || info->magic > '7' || info->w <= 0
+	    || info->h <= 0 || format < PNM_RGBA32 || format > PNM_BIT1) {
+		fprintf(stderr, "Error writing Pnm file; invalid image.\n");
+		return false;
+	}
+
+	wr->magic    = info->magic;
+	wr->w        = info->w;
+	wr->h        = info->h;
+	wr->channels = SHYPNM_FormatChannels(format);
+	wr->maxval   = info->maxval;
+	if (!wr->maxval && format == PNM_BIT1) {
+		wr->maxval = 1;
+	} else if (!wr->maxval) {
+		wr->maxval = SHYPNM_FormatWide(format) ? UINT16_MAX : UINT8_MAX;
+	}
+
+	switch (wr->magic) {
+	case '1':
+	case '4':
+		wr->depth  = 1;
+		wr->maxval = 1;
+		break;
+	case '2':
+	case '5':
+		wr->depth = 1;
+		break;
+	case '3':
+	case '6':
+		wr->depth = 3;
+		break;
+	default:
+		wr->depth = info->depth ? info->depth : wr->channels;
+		break;
+	}
+
+	if (wr->depth < 1 || wr->depth > 4 || wr->maxval < 1
+	    || wr->maxval > UINT16_MAX) {
+		fprintf(stderr,
+		        "Error writing Pnm file; invalid depth or maxval.\n");
+		return false;
+	}
+
+	wr->tupltype = info->tupltype;
+	if (!info->tupltype[0]) {
+		wr->tupltype = wr->depth == 1 && wr->maxval == 1
+		                   ? "BLACKANDWHITE"
+		                   : tupltypes[wr->depth - 1];
+	}
+	for (int v = wr->maxval; v; v /= 10) {
+		wr->digits++;
+	}
+	return true;
+}
+
+size_t SHYPNM_SaveSize(const SHYPNM_Writer *wr)
+{
+	// Gives an upper bound on the size of the file.
+	size_t n = (size_t)wr->w * wr->depth;
+	size_t row;
+
+	switch (wr->magic) {
+	case '1':
+		row = wr->w + wr->w / SHYPNM_LINEMAX + 1;
+		break;
+	case '2':
+	case '3':
+		row = SHYPNM_TextRowSize(wr);
+		break;
+	case '4':
+		row = ((size_t)wr->w + 7) / 8;
+		break;
+	default:
+		row = wr->maxval > UINT8_MAX ? n * 2 : n;
+		break;
+	}
+	return SHYPNM_HEADERMAX + row * wr->h;
+}
+
+bool SHYPNM_WriterTables(SHYPNM_Writer *wr)
+{
+	// Builds the table which rescales samples to maxval, unless they
+	// already span it, and for plain images the digits of every value up
+	// to maxval, each as a length followed by up to five characters.
+	uint32_t from = SHYPNM_FormatWide(wr->format) ? UINT16_MAX : UINT8_MAX;
+
+	if (wr->magic == '1' || wr->magic == '4') {
+		return true;
+	}
+
+	if (wr->maxval != (int)from) {
+		wr->scale = SHYPNM_MALLOC((from + 1) * sizeof(uint16_t));
+		if (!wr->scale) {
+			perror(strerror(errno));
+			return false;
+		}
+		for (uint32_t v = 0; v <= from; v++) {
+			wr->scale[v] = SHYPNM_RESCALE(v, from, wr->maxval);
+		}
+	}
+
+	if (wr->magic == '2' || wr->magic == '3') {
+		wr->text = SHYPNM_MALLOC(((size_t)wr->maxval + 1) * 8);
+		if (!wr->text) {
+			perror(strerror(errno));
+			return false;
+		}
+		for (int v = 0; v <= wr->maxval; v++) {
+			uint8_t *digits = wr->text + v * 8;
+			int      len    = 0;
+			for (int rest = v; len == 0 || rest; rest /= 10) {
+				len++;
+			}
+			digits[0] = len;
+			for (int i = len, rest = v; i > 0; i--, rest /= 10) {
+				digits[i] = '0' + rest % 10;
+			}
+		}
+	}
+
+	return true;
+}
+
+bool SHYPNM_WriteImage(SHYPNM_Writer *wr, const void *pix, size_t stride)
+{
+	// Writes the header and every row of pix. Binary rows which are
+	// already in the form of the file are written straight from pix.
+	size_t rowsize = SHYPNM_FormatRowSize(wr->format, wr->w);
+	size_t size    = SHYPNM_SaveSize(wr);
+	size_t n       = (size_t)wr->w * 4;
+	bool   direct  = wr->format == PNM_BIT1 && wr->magic == '4';
+
+	if (wr->magic >= '5' && wr->maxval == UINT8_MAX
+	    && wr->depth == wr->channels && wr->format != PNM_RGBA32
+	    && wr->format != PNM_BIT1 && !SHYPNM_FormatWide(wr->format)) {
+		direct = true;
+	}
+	stride = stride ? stride : rowsize;
+
+	wr->cap = size;
+	if (wr->f && size > SHYPNM_WRITEBLOCK) {
+		wr->cap = SHYPNM_WRITEBLOCK;
+	}
+
+	wr->buf    = SHYPNM_MALLOC(wr->cap);
+	wr->narrow = SHYPNM_MALLOC(n);
+	wr->temp   = SHYPNM_MALLOC(n);
+	if (SHYPNM_FormatWide(wr->format)) {
+		wr->wide = SHYPNM_MALLOC(n * sizeof(uint16_t));
+	}
+	if (!wr->buf || !wr->narrow || !wr->temp
+	    || (SHYPNM_FormatWide(wr->format) && !wr->wide)) {
+		perror(strerror(errno));
+		return false;
+	} else if (!SHYPNM_WriterTables(wr) || !SHYPNM_WriteHeader(wr)) {
+		return false;
+	}
+
+	if (wr->f && direct && stride == rowsize) {
+		if (!SHYPNM_WriteFlush(wr)) {
+			return false;
+		} else if (fwrite(pix, rowsize, wr->h, wr->f)
+		           != (size_t)wr->h) {
+			fprintf(stderr, "Error writing Pnm file; %s.\n",
+			        strerror(errno));
+			return false;
+		}
+		return true;
+	}
+
+	return SHYPNM_SaveRows(wr, pix, stride) && SHYPNM_WriteFlush(wr);
+}
+
+void SHYPNM_CloseWriter(SHYPNM_Writer *wr)
+{
+	if (wr->f) {
+		SHYPNM_FREE(wr->buf);
+	}
+	SHYPNM_FREE(wr->scale);
+	SHYPNM_FREE(wr->text);
+	SHYPNM_FREE(wr->narrow);
+	SHYPNM_FREE(wr->wide);
+	SHYPNM_FREE(wr->temp);
+}
+
+int PnmSave(const char *   filename,
+            const PnmInfo *info,
+            const void *   pix,
+            size_t         stride,
+            int            format)
+{
+	SHYPNM_Writer wr;
+	if (!SHYPNM_OpenWriter(&wr, info, format)) {
+		return 0;
+	}
+
+	wr.f = fopen(filename, "wb");
+	if (!wr.f) {
+		fprintf(stderr, "Error opening file '%s'.\n", filename);
+		return 0;
+	}
+
+	bool ok = SHYPNM_WriteImage(&wr, pix, stride);
+	SHYPNM_CloseWriter(&wr);
+
+	if (fclose(wr.f) && ok) {
+		fprintf(stderr,
+		        "Error writing Pnm file; %s.\n",
+		        strerror(errno));
+		ok = false;
+	}
+	return ok;
+}
+
+void *PnmSaveMemory(const PnmInfo *info,
+                    const void *   pix,
+                    size_t         stride,
+                    int            format,
+                    size_t *       len)
+{
+	SHYPNM_Writer wr;
+	bool ok = SHYPNM_OpenWriter(&wr, info, format)
+	          && SHYPNM_WriteImage(&wr, pix, stride);
+
+	SHYPNM_CloseWriter(&wr);
+	if (!ok) {
+		SHYPNM_FREE(wr.buf);
+		wr.buf  = NULL;
+		wr.used = 0;
+	}
+
+	*len = wr.used;
+	return wr.buf;
+}
+
+#ifdef SHYPNM_HAVE_PTHREADS
+
+// Runs fn(ctx, i) for every i in [0, n), each on its own thread. The calling
+// thread runs the first call itself, and also takes over any call whose
+// thread could not be started. Counters kept by the other threads are added
+// to the caller's statistics once they are joined.
+typedef void (*SHYPNM_TaskFunc)(void *ctx, int index);
+
+typedef struct {
+	SHYPNM_TaskFunc fn;
+	void *          ctx;
+	int             index;
+	bool            started;
+	pthread_t       thread;
+#ifdef SHY_PNM_STATS
+	SHYPNM_StatState stats;
+#endif
+} SHYPNM_Task;
+
+void *SHYPNM_TaskThread(void *arg)
+{
+	SHYPNM_Task *task = arg;
+	task->fn(task->ctx, task->index);
+#ifdef SHY_PNM_STATS
+	task->stats = SHYPNM_Stats;
+#endif
+	return NULL;
+}
+
+bool SHYPNM_RunParallel(int n, SHYPNM_TaskFunc fn, void *ctx)
+{
+	SHYPNM_Task *tasks = SHYPNM_CALLOC(n, sizeof(SHYPNM_Task));
+	if (!tasks) {
+		perror(strerror(errno));
+		return false;
+	}
+
+	SHYPNM_STATENTER(SHYPNM_PHASEDECODE);
+	SHYPNM_STATMAX(threads, n);
+	for (int i = 1; i < n; i++) {
+		tasks[i] = (SHYPNM_Task){.fn = fn, .ctx = ctx, .index = i};
+		tasks[i].started = !pthread_create(
+		    &tasks[i].thread, NULL, SHYPNM_TaskThread, &tasks[i]);
+	}
+	fn(ctx, 0);
+	for (int i = 1; i < n; i++) {
+		if (tasks[i].started) {
+			pthread_join(tasks[i].thread, NULL);
+#ifdef SHY_PNM_STATS
+			SHYPNM_StatMerge(&tasks[i].stats);
+#endif
+		} else {
+			fn(ctx, i);
+		}
+	}
+	SHYPNM_STATLEAVE();
+
+	SHYPNM_FREE(tasks);
+	return true;
+}
+
+int SHYPNM_ThreadCount(int nthreads)
+{
+	if (nthreads < 1) {
+		nthreads = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n > 1) {
+			nthreads = n;
+		}
+#endif
+	}
+
+	return nthreads;
+}
+
+// Parallel loading splits a binary raster into bands of rows, each decoded
+// by its own thread. Since every row has the same size, the offset of a band
+// follows from the end of the header, and each thread reads its band with
+// pread() in chunks of about SHYPNM_BANDCHUNK bytes.
+#define SHYPNM_BANDCHUNK (1 << 20)
+
+typedef struct {
+	int                 fd;
+	off_t               offset;
+	uint32_t *          pix;
+	int                 w;
+	int                 depth;
+	size_t              rowsize;
+	const SHYPNM_Scale *scale;
+	int                 y0;
+	int                 y1;
+	bool                ok;
+} SHYPNM_Band;
+
+void SHYPNM_BandWorker(void *ctx, int index)
+{
+	SHYPNM_Band *band = (SHYPNM_Band *)ctx + index;
+
+	int chunk = SHYPNM_BANDCHUNK / band->rowsize;
+	if (chunk < 1) {
+		chunk = 1;
+	} else if (chunk > band->y1 - band->y0) {
+		chunk = band->y1 - band->y0;
+	}
+
+	uint8_t *buf    = SHYPNM_MALLOC(band->rowsize * chunk);
+	uint8_t *scaled = NULL;
+	if (band->scale->table) {
+		scaled = SHYPNM_MALLOC((size_t)band->w * band->depth);
+	}
+	if (!buf || (band->scale->table && !scaled)) {
+		perror(strerror(errno));
+		SHYPNM_FREE(buf);
+		SHYPNM_FREE(scaled);
+		band->ok = false;
+		return;
+	}
+
+	band->ok = true;
+	for (int y = band->y0; band->ok && y < band->y1; y += chunk) {
+		int    rows   = chunk < band->y1 - y ? chunk : band->y1 - y;
+		size_t size   = band->rowsize * rows;
+		off_t  offset = band->offset + (off_t)band->rowsize * y;
+		if (!SHYPNM_Pread(band->fd, buf, size, offset)) {
+			fprintf(stderr,
+			        "Error reading Pnm file; unexpected "
+			        "end-of-file reached while reading pixel "
+			        "data.\n");
+			band->ok = false;
+			break;
+		}
+
+		for (int i = 0; band->ok && i < rows; i++) {
+			band->ok = SHYPNM_DecodeRow(
+			    buf + band->rowsize * i,
+			    scaled,
+			    band->pix + (size_t)(y + i) * band->w,
+			    band->w,
+			    band->depth,
+			    band->scale);
+		}
+	}
+
+	SHYPNM_FREE(buf);
+	SHYPNM_FREE(scaled);
+}
+
+bool SHYPNM_ParallelDecode(int       fd,
+                           off_t     offset,
+                           uint32_t *pix,
+                           int       w,
+                           int       h,
+                           int       depth,
+                           int       maxval,
+                           int       nthreads)
+{
+	SHYPNM_Scale scale;
+	SHYPNM_Lut * lut;
+	if (!SHYPNM_PrepareScale(maxval, depth, &scale, &lut)) {
+		return false;
+	}
+
+	if (nthreads > h) {
+		nthreads = h;
+	}
+	SHYPNM_Band *bands = SHYPNM_CALLOC(nthreads, sizeof(SHYPNM_Band));
+	if (!bands) {
+		perror(strerror(errno));
+		SHYPNM_ReleaseLut(lut);
+		return false;
+	}
+
+	for (int i = 0; i < nthreads; i++) {
+		bands[i] = (SHYPNM_Band){
+		    .fd      = fd,
+		    .offset  = offset,
+		    .pix     = pix,
+		    .w       = w,
+		    .depth   = depth,
+		    .rowsize = SHYPNM_RowSize(w, depth, maxval),
+		    .scale   = &scale,
+		    .y0      = (int)((int64_t)h * i / nthreads),
+		    .y1      = (int)((int64_t)h * (i + 1) / nthreads),
+		};
+	}
+
+	bool ok = SHYPNM_RunParallel(nthreads, SHYPNM_BandWorker, bands);
+	for (int i = 0; ok && i < nthreads; i++) {
+		ok = bands[i].ok;
+	}
+
+	SHYPNM_ReleaseLut(lut);
+	SHYPNM_FREE(bands);
+	return ok;
+}
+
+// Plain formats are parsed in parallel in two passes over the mapped file. The
+// body is split into one chunk per thread, with no chunk starting inside a
+// comment or a token, so that bodies written as a single line are split as well
+// as those with a row per line. The first pass counts the samples in each
+// chunk, and a prefix sum over the counts gives the index of the first sample
+// of every chunk. The second pass then converts each chunk independently. Plain
+// PGM and PPM samples are collected into 8-bit rows first, since a pixel may be
+// split between two chunks, and packed into pixels in a third pass.
+typedef struct {
+	const uint8_t *start;
+	const uint8_t *end;
+	size_t         count;
+	size_t         first;
+	bool           ok;
+} SHYPNM_TextChunk;
+
+typedef struct {
+	SHYPNM_TextChunk *chunks;
+	int               nchunks;
+	int               magic;
+	size_t            needed;
+	const SHYPNM_Lut *lut;
+	uint32_t *        pix;
+	uint8_t *         samples;
+	int               w;
+	int               h;
+} SHYPNM_TextJob;
+
+void SHYPNM_TextCount(void *ctx, int index)
+{
+	SHYPNM_TextJob *  job   = ctx;
+	SHYPNM_TextChunk *chunk = &job->chunks[index];
+	const uint8_t *   p     = chunk->start;
+	const uint8_t *   end   = chunk->end;
+	size_t            count = 0;
+	bool              token = false;
+#ifdef SHYPNM_HAVE_X86_SIMD
+	bool avx2 = SHYPNM_SimdLevel() == SHYPNM_SIMDAVX2;
+#endif
+
+	while (p < end) {
+#ifdef SHYPNM_HAVE_X86_SIMD
+		if (avx2) {
+			count += SHYPNM_CountTokensAvx2(
+			    &p, end, job->magic == '1', &token);
+			SHYPNM_STATMAX(simd, SHYPNM_SIMDAVX2);
+			if (p == end) {
+				break;
+			}
+		}
+#endif
+		if (*p == '#') {
+			const uint8_t *nl = memchr(p, '\n', end - p);
+			p                 = nl ? nl : end;
+			token             = false;
+		} else if (job->magic == '1') {
+			count += *p == '0' || *p == '1';
+			p++;
+		} else if (isspace(*p)) {
+			token = false;
+			p++;
+		} else {
+			count += !token;
+			token = true;
+			p++;
+		}
+	}
+
+	chunk->count = count;
+}
+
+void SHYPNM_TextParse(void *ctx, int index)
+{
+	SHYPNM_TextJob *  job   = ctx;
+	SHYPNM_TextChunk *chunk = &job->chunks[index];
+	const uint8_t *   p     = chunk->start;
+	size_t            n     = chunk->first;
+	size_t            last  = chunk->first + chunk->count;
+
+	if (last > job->needed) {
+		last = job->needed;
+	}
+	if (n >= last) {
+		chunk->ok = true;
+		return;
+	} else if (job->magic != '1') {
+		chunk->ok = SHYPNM_ScanSamples(
+		    &p, chunk->end, job->lut, job->samples + n, last - n);
+		return;
+	}
+
+	for (; n < last && p < chunk->end; p++) {
+		if (*p == '#') {
+			while (p < chunk->end && *p != '\n') {
+				p++;
+			}
+		} else if (*p == '0') {
+			job->pix[n++] = 0xffffffff;
+		} else if (*p == '1') {
+			job->pix[n++] = 0x000000ff;
+		}
+	}
+	chunk->ok = true;
+}
+
+void SHYPNM_TextPack(void *ctx, int index)
+{
+	SHYPNM_TextJob *job = ctx;
+	int64_t         h   = job->h;
+	int             y0  = (int)(h * index / job->nchunks);
+	int             y1  = (int)(h * (index + 1) / job->nchunks);
+
+	for (int y = y0; y < y1; y++) {
+		uint32_t *row = job->pix + (size_t)y * job->w;
+		if (job->magic == '2') {
+			SHYPNM_GrayscaleRow8(job->samples + (size_t)y * job->w,
+			                     row,
+			                     job->w,
+			                     false);
+		} else {
+			SHYPNM_ColorRow8(job->samples + (size_t)y * job->w * 3,
+			                 row,
+			                 job->w,
+			                 false);
+		}
+	}
+}
+
+const uint8_t *SHYPNM_TextSplit(const uint8_t *prev,
+                                const uint8_t *p,
+                                const uint8_t *end,
+                                bool           bitmap)
+{
+	// Moves p forward to where a chunk may start. prev is the start of the
+	// previous chunk, which is outside any comment, so p is inside one if
+	// the nearest newline or '#' before it, back to prev, is a '#'. Plain
+	// PGM and PPM chunks then start at the end of the token p is in, while
+	// bitmap samples are single characters and need no such care.
+	const uint8_t *q = p;
+	while (q > prev && q[-1] != '\n' && q[-1] != '#') {
+		q--;
+	}
+	if (q > prev && q[-1] == '#') {
+		p = memchr(p, '\n', end - p);
+		return p ? p + 1 : end;
+	}
+
+	while (!bitmap && p < end && !isspace(*p) && *p != '#') {
+		p++;
+	}
+	return p;
+}
+
+bool SHYPNM_ParallelText(SHYPNM_TextJob *job,
+                         const uint8_t * body,
+                         size_t          size,
+                         int             nthreads)
+{
+	job->nchunks = nthreads;
+	job->chunks  = SHYPNM_CALLOC(nthreads, sizeof(SHYPNM_TextChunk));
+	if (!job->chunks) {
+		perror(strerror(errno));
+		return false;
+	}
+
+	const uint8_t *end  = body + size;
+	const uint8_t *prev = body;
+	for (int i = 0; i < nthreads; i++) {
+		const uint8_t *p = body + (uint64_t)size * i / nthreads;
+		if (p < prev) {
+			p = prev;
+		} else if (i > 0) {
+			p = SHYPNM_TextSplit(prev, p, end, job->magic == '1');
+		}
+		job->chunks[i].start = p;
+		if (i > 0) {
+			job->chunks[i - 1].end = p;
+		}
+		prev = p;
+	}
+	job->chunks[nthreads - 1].end = end;
+
+	bool ok = SHYPNM_RunParallel(nthreads, SHYPNM_TextCount, job);
+
+	size_t total = 0;
+	for (int i = 0; i < nthreads; i++) {
+		job->chunks[i].first = total;
+		total += job->chunks[i].count;
+	}
+	if (ok && total < job->needed) {
+		fprintf(stderr,
+		        "Error reading Pnm file; unexpected end-of-file "
+		        "reached while reading pixel data.\n");
+		ok = false;
+	}
+
+	if (ok) {
+		ok = SHYPNM_RunParallel(nthreads, SHYPNM_TextParse, job);
+	}
+	for (int i = 0; ok && i < nthreads; i++) {
+		ok = job->chunks[i].ok;
+	}
+
+	if (ok && job->samples) {
+		ok = SHYPNM_RunParallel(nthreads, SHYPNM_TextPack, job);
+	}
+
+	SHYPNM_FREE(job->chunks);
+	return ok;
+}
+
+uint32_t *SHYPNM_ParallelTextLoad(const char *filename,
+                                  int *       w,
+                                  int *       h,
+                                  int         nthreads)
+{
+	int fd = SHYPNM_OpenFd(filename);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	void *      data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (data == MAP_FAILED) {
+		close(fd);
+		return PnmLoad(filename, w, h);
+	}
+	SHYPNM_STATADD(io_calls, 1);
+	SHYPNM_STATADD(bytes_read, st.st_size);
+
+	SHYPNM_Source  src = SHYPNM_MemorySource(data, st.st_size);
+	SHYPNM_TextJob job = {0};
+	SHYPNM_Header  hdr;
+
+	bool ok = SHYPNM_ParseHeader(&src, filename, &hdr);
+	if (ok) {
+		job.magic = hdr.magic;
+		job.pix   = SHYPNM_AllocPixels(hdr.w, hdr.h);
+		ok        = job.pix != NULL;
+	}
+	if (ok) {
+		job.lut = SHYPNM_AcquireLut(hdr.maxval);
+		ok      = job.lut != NULL;
+	}
+	if (ok) {
+		*w         = hdr.w;
+		*h         = hdr.h;
+		job.w      = hdr.w;
+		job.h      = hdr.h;
+		job.needed = (size_t)hdr.w * hdr.h * hdr.depth;
+		if (job.magic != '1') {
+			job.samples = SHYPNM_MALLOC(job.needed);
+			if (!job.samples) {
+				perror(strerror(errno));
+				ok = false;
+			}
+		}
+	}
+	if (ok) {
+		ok = SHYPNM_ParallelText(&job,
+		                         src.data + src.pos,
+		                         src.size - src.pos,
+		                         nthreads < *h ? nthreads : *h);
+	}
+	if (!ok) {
+		*w = -1;
+		*h = -1;
+		SHYPNM_FREE(job.pix);
+		job.pix = NULL;
+	}
+
+	SHYPNM_ReleaseLut((SHYPNM_Lut *)job.lut);
+	SHYPNM_FREE(job.samples);
+	munmap(data, st.st_size);
+	close(fd);
+
+	return job.pix;
+}
+
+uint32_t *PnmLoadParallel(const char *filename, int *w, int *h, int nthreads)
+{
+	nthreads = SHYPNM_ThreadCount(nthreads);
+
+	FILE *f = SHYPNM_OpenFile(filename);
+	if (!f) {
+		return NULL;
+	}
+
+	SHYPNM_Source src = SHYPNM_FileSource(f);
+	SHYPNM_Header hdr;
+	uint32_t *    pix;
+
+	if (!SHYPNM_ParseHeader(&src, filename, &hdr)) {
+		*w = -1;
+		*h = -1;
+		fclose(f);
+		return NULL;
+	} else if (hdr.magic <= '3') {
+		fclose(f);
+		return SHYPNM_ParallelTextLoad(filename, w, h, nthreads);
+	}
+
+	pix = SHYPNM_AllocPixels(hdr.w, hdr.h);
+	if (!pix
+	    || !SHYPNM_ParallelDecode(fileno(f),
+	                              ftell(f),
+	                              pix,
+	                              hdr.w,
+	                              hdr.h,
+	                              hdr.magic == '4' ? 0 : hdr.depth,
+	                              hdr.maxval,
+	                              nthreads)) {
+		SHYPNM_FREE(pix);
+		pix = NULL;
+	}
+
+	*w = pix ? hdr.w : -1;
+	*h = pix ? hdr.h : -1;
+	fclose(f);
+	return pix;
+}
+
+// Batches of files are each read whole into memory and decoded from there by
+// a pool of threads. With io_uring, the calling thread keeps up to depth
+// files open and queued for reading in the kernel, and hands each one to the
+// decoding threads as soon as its last byte arrives. Otherwise the threads
+// read and decode files of their own one at a time, which they also do for
+// every file the ring fails to read, including those still in the ring when
+// it fails as a whole.
+#define SHYPNM_BATCHDEPTH 64
+
+typedef struct {
+	int      fd;
+	uint8_t *data;
+	size_t   size;
+	size_t   done;
+	bool     queued;
+	bool     retry;
+	uint8_t *abandoned;
+} SHYPNM_BatchFile;
+
+#ifdef SHYPNM_HAVE_IO_URING
+
+// The ring is driven with raw system calls, so no library is needed. Each
+// file has at most one operation in the ring at a time, tagged with the
+// index of the file.
+typedef struct {
+	int                  fd;
+	unsigned             queued;
+	unsigned *           sq_tail;
+	unsigned *           sq_mask;
+	unsigned *           sq_array;
+	unsigned *           cq_head;
+	unsigned *           cq_tail;
+	unsigned *           cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *               sq_ring;
+	void *               cq_ring;
+	size_t               sq_size;
+	size_t               cq_size;
+	size_t               sqes_size;
+} SHYPNM_Ring;
+
+#endif
+
+typedef struct {
+	const char *const *paths;
+	PnmImage *         results;
+	SHYPNM_BatchFile * files;
+	int *              ready;
+	int *              retry;
+	int                nretry;
+	int                n;
+	int                format;
+	int                depth;
+	int                head;
+	int                tail;
+	int                next;
+	int                outstanding;
+	bool               reading;
+	pthread_mutex_t    mutex;
+	pthread_cond_t     cond;
+#ifdef SHYPNM_HAVE_IO_URING
+	SHYPNM_Ring ring;
+#endif
+} SHYPNM_Batch;
+
+bool SHYPNM_ReadFile(const char *path, SHYPNM_BatchFile *file)
+{
+	// Reads a whole file into a new buffer with as few calls as possible.
+	struct stat st;
+	int         fd = SHYPNM_OpenFd(path);
+
+	if (fd < 0) {
+		return false;
+	} else if (fstat(fd, &st) || st.st_size <= 0) {
+		fprintf(stderr, "Error reading Pnm file; file is empty.\n");
+		close(fd);
+		return false;
+	}
+
+	file->size = st.st_size;
+	file->data = SHYPNM_MALLOC(file->size);
+	if (!file->data) {
+		perror(strerror(errno));
+		close(fd);
+		return false;
+	}
+	while (file->done < file->size) {
+		size_t  left = file->size - file->done;
+		ssize_t n    = read(fd, file->data + file->done, left);
+		SHYPNM_STATADD(io_calls, 1);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			fprintf(stderr,
+			        "Error reading file '%s'; %s.\n",
+			        path,
+			        strerror(errno));
+			SHYPNM_FREE(file->data);
+			file->data = NULL;
+			close(fd);
+			return false;
+		} else if (n == 0) {
+			break;
+		}
+		SHYPNM_STATADD(bytes_read, n);
+		file->done += n;
+	}
+
+	close(fd);
+	return true;
+}
+
+void SHYPNM_BatchDecode(SHYPNM_Batch *batch, int i)
+{
+	// Decodes file i from memory, and frees its bytes.
+	SHYPNM_BatchFile *file   = &batch->files[i];
+	PnmImage *        result = &batch->results[i];
+	PnmSource         source = {.data = file->data, .size = file->done};
+
+	result->pix = PnmLoadEx(&source, batch->format, &result->w, &result->h);
+	SHYPNM_FREE(file->data);
+	file->data = NULL;
+}
+
+bool SHYPNM_BatchTake(SHYPNM_Batch *batch, int *i)
+{
+	// Takes the next file read by the ring, with the mutex held.
+	if (batch->head == batch->tail) {
+		return false;
+	}
+	*i = batch->ready[batch->head++];
+	return true;
+}
+
+void SHYPNM_BatchDone(SHYPNM_Batch *batch)
+{
+	// Makes room for another file in the ring, with the mutex held.
+	batch->outstanding--;
+	pthread_cond_broadcast(&batch->cond);
+}
+
+#ifdef SHYPNM_HAVE_IO_URING
+
+void SHYPNM_BatchRetry(SHYPNM_Batch *batch, int i)
+{
+	// Hands file i over to the threads to read again, with the mutex held.
+	// The buffer of a file still in the ring is only released once the
+	// ring is closed, since the kernel may yet read into it.
+	SHYPNM_BatchFile *file = &batch->files[i];
+	uint8_t *         data = file->data;
+
+	if (file->fd >= 0) {
+		close(file->fd);
+	}
+	if (file->queued) {
+		file->abandoned = data;
+	} else {
+		SHYPNM_FREE(data);
+	}
+	*file = (SHYPNM_BatchFile){.fd = -1, .abandoned = file->abandoned};
+	batch->retry[batch->nretry++] = i;
+	SHYPNM_BatchDone(batch);
+}
+
+void SHYPNM_CloseRing(SHYPNM_Ring *ring)
+{
+	if (ring->sqes && ring->sqes != MAP_FAILED) {
+		munmap(ring->sqes, ring->sqes_size);
+	}
+	if (ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+		munmap(ring->cq_ring, ring->cq_size);
+	}
+	if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+		munmap(ring->sq_ring, ring->sq_size);
+	}
+	close(ring->fd);
+}
+
+bool SHYPNM_OpenRing(SHYPNM_Ring *ring, unsigned entries)
+{
+	// Fails quietly where io_uring is missing or blocked, or too old to
+	// open files (before Linux 5.6, which added IORING_FEAT_RW_CUR_POS).
+	struct io_uring_params p     = {0};
+	int                    prot  = PROT_READ | PROT_WRITE;
+	int                    flags = MAP_SHARED | MAP_POPULATE;
+
+	*ring    = (SHYPNM_Ring){0};
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0) {
+		return false;
+	} else if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		return false;
+	}
+
+	ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_size
+	    = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(
+	    NULL, ring->sq_size, prot, flags, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(
+	    NULL, ring->cq_size, prot, flags, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(
+	    NULL, ring->sqes_size, prot, flags, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED
+	    || ring->sqes == MAP_FAILED) {
+		SHYPNM_CloseRing(ring);
+		return false;
+	}
+
+	uint8_t *sq    = ring->sq_ring;
+	uint8_t *cq    = ring->cq_ring;
+	ring->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->cq_head  = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return true;
+}
+
+struct io_uring_sqe *SHYPNM_RingQueue(SHYPNM_Ring *ring, int opcode, int i)
+{
+	// Returns a cleared entry for an operation on file i, to be submitted
+	// by the next SHYPNM_RingWait().
+	unsigned             tail = *ring->sq_tail;
+	unsigned             slot = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe  = &ring->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode          = opcode;
+	sqe->user_data       = i;
+	ring->sq_array[slot] = slot;
+
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+	return sqe;
+}
+
+void SHYPNM_QueueOpen(SHYPNM_Ring *ring, SHYPNM_Batch *batch, int i)
+{
+	struct io_uring_sqe *sqe = SHYPNM_RingQueue(ring, IORING_OP_OPENAT, i);
+
+	sqe->fd         = AT_FDCWD;
+	sqe->addr       = (uintptr_t)batch->paths[i];
+	sqe->open_flags = O_RDONLY;
+}
+
+void SHYPNM_QueueRead(SHYPNM_Ring *ring, SHYPNM_Batch *batch, int i)
+{
+	// Reads are split at 1GB, so their length fits in the entry.
+	SHYPNM_BatchFile *   file = &batch->files[i];
+	size_t               left = file->size - file->done;
+	struct io_uring_sqe *sqe  = SHYPNM_RingQueue(ring, IORING_OP_READ, i);
+
+	sqe->fd   = file->fd;
+	sqe->addr = (uintptr_t)(file->data + file->done);
+	sqe->len  = left < (1u << 30) ? left : (1u << 30);
+	sqe->off  = file->done;
+}
+
+bool SHYPNM_RingWait(SHYPNM_Ring *ring)
+{
+	// Submits the queued entries and waits for at least one completion.
+	for (;;) {
+		SHYPNM_STATADD(io_calls, 1);
+		long n = syscall(__NR_io_uring_enter,
+		                 ring->fd,
+		                 ring->queued,
+		                 1,
+		                 IORING_ENTER_GETEVENTS,
+		                 NULL,
+		                 0);
+		if (n >= 0) {
+			ring->queued -= n;
+			return true;
+		} else if (errno != EINTR && errno != EAGAIN
+		           && errno != EBUSY) {
+			perror(strerror(errno));
+			return false;
+		}
+	}
+}
+
+bool SHYPNM_RingComplete(SHYPNM_Batch *batch, int i, int res)
+{
+	// Handles the result of the open or read of file i, and queues its
+	// next read. Returns true once nothing more is to be read. Failed
+	// opens and reads are marked to be retried by the threads, which
+	// report the error if they fail as well.
+	SHYPNM_BatchFile *file = &batch->files[i];
+	SHYPNM_Ring *     ring = &batch->ring;
+	struct stat       st;
+
+	if (res == -EINTR || res == -EAGAIN) {
+		if (file->fd < 0) {
+			SHYPNM_QueueOpen(ring, batch, i);
+		} else {
+			SHYPNM_QueueRead(ring, batch, i);
+		}
+		return false;
+	}
+
+	if (res < 0) {
+		file->retry = true;
+		return true;
+	} else if (file->fd < 0) {
+		file->fd = res;
+		if (fstat(file->fd, &st) || st.st_size <= 0) {
+			fprintf(stderr,
+			        "Error reading Pnm file; file is empty.\n");
+			return true;
+		}
+		file->size = st.st_size;
+		file->data = SHYPNM_MALLOC(file->size);
+		if (!file->data) {
+			perror(strerror(errno));
+			return true;
+		}
+	} else if (res == 0 || (file->done += res) == file->size) {
+		SHYPNM_STATADD(bytes_read, file->done);
+		return true;
+	}
+
+	SHYPNM_QueueRead(ring, batch, i);
+	return false;
+}
+
+void SHYPNM_BatchRing(SHYPNM_Batch *batch)
+{
+	// Keeps up to depth files in the ring or waiting to be decoded. When
+	// the ring is full of decoded files, it decodes some of them itself
+	// rather than wait for the other threads.
+	SHYPNM_Ring *ring     = &batch->ring;
+	int          inflight = 0;
+	bool         ok       = true;
+	int          i;
+
+	while (ok && (batch->next < batch->n || inflight)) {
+		pthread_mutex_lock(&batch->mutex);
+		while (!inflight && batch->outstanding >= batch->depth) {
+			if (SHYPNM_BatchTake(batch, &i)) {
+				pthread_mutex_unlock(&batch->mutex);
+				SHYPNM_BatchDecode(batch, i);
+				pthread_mutex_lock(&batch->mutex);
+				SHYPNM_BatchDone(batch);
+			} else {
+				pthread_cond_wait(&batch->cond, &batch->mutex);
+			}
+		}
+		while (batch->next < batch->n
+		       && batch->outstanding < batch->depth) {
+			batch->files[batch->next].queued = true;
+			SHYPNM_QueueOpen(ring, batch, batch->next++);
+			batch->outstanding++;
+			inflight++;
+		}
+		pthread_mutex_unlock(&batch->mutex);
+
+		ok = SHYPNM_RingWait(ring);
+
+		unsigned head = *ring->cq_head;
+		unsigned tail
+		    = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe
+			    = &ring->cqes[head & *ring->cq_mask];
+			i = cqe->user_data;
+			if (!SHYPNM_RingComplete(batch, i, cqe->res)) {
+				continue;
+			}
+
+			SHYPNM_BatchFile *file = &batch->files[i];
+			file->queued           = false;
+			inflight--;
+			pthread_mutex_lock(&batch->mutex);
+			if (file->retry) {
+				SHYPNM_BatchRetry(batch, i);
+			} else {
+				if (file->fd >= 0) {
+					close(file->fd);
+					file->fd = -1;
+				}
+				if (file->data) {
+					batch->ready[batch->tail++] = i;
+					pthread_cond_broadcast(&batch->cond);
+				} else {
+					SHYPNM_BatchDone(batch);
+				}
+			}
+			pthread_mutex_unlock(&batch->mutex);
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	// Files left in a failed ring are handed over to the threads.
+	pthread_mutex_lock(&batch->mutex);
+	for (i = 0; i < batch->next; i++) {
+		if (batch->files[i].queued) {
+			SHYPNM_BatchRetry(batch, i);
+		}
+	}
+	batch->reading = false;
+	pthread_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+#endif
+
+void SHYPNM_BatchWorker(void *ctx, int index)
+{
+	// Decodes files read by the ring until it is done, then reads and
+	// decodes any files it left.
+	SHYPNM_Batch *batch = ctx;
+	int           i;
+
+#ifdef SHYPNM_HAVE_IO_URING
+	if (index == 0 && batch->reading) {
+		SHYPNM_BatchRing(batch);
+		return;
+	}
+#else
+	(void)index;
+#endif
+
+	pthread_mutex_lock(&batch->mutex);
+	for (;;) {
+		if (SHYPNM_BatchTake(batch, &i)) {
+			pthread_mutex_unlock(&batch->mutex);
+			SHYPNM_BatchDecode(batch, i);
+			pthread_mutex_lock(&batch->mutex);
+			SHYPNM_BatchDone(batch);
+		} else if (batch->nretry
+		           || (!batch->reading && batch->next < batch->n)) {
+			i = batch->nretry ? batch->retry[--batch->nretry]
+			                  : batch->next++;
+			pthread_mutex_unlock(&batch->mutex);
+			SHYPNM_BatchFile *file = &batch->files[i];
+			if (SHYPNM_ReadFile(batch->paths[i], file)) {
+				SHYPNM_BatchDecode(batch, i);
+			}
+			pthread_mutex_lock(&batch->mutex);
+		} else if (batch->reading) {
+			pthread_cond_wait(&batch->cond, &batch->mutex);
+		} else {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&batch->mutex);
+}
+
+int PnmLoadBatch(const char *const *    paths,
+                 int                    n,
+                 PnmImage *             results,
+                 const PnmBatchOptions *opts)
+{
+	PnmBatchOptions defaults = {0};
+	SHYPNM_Batch    batch    = {.paths = paths, .results = results, .n = n};
+	int             loaded   = 0;
+
+	opts         = opts ? opts : &defaults;
+	batch.format = opts->format;
+	batch.depth  = opts->depth > 0 ? opts->depth : SHYPNM_BATCHDEPTH;
+	batch.files  = SHYPNM_CALLOC(n, sizeof(SHYPNM_BatchFile));
+	batch.ready  = SHYPNM_CALLOC(n, sizeof(int));
+	batch.retry  = SHYPNM_CALLOC(n, sizeof(int));
+	for (int i = 0; i < n; i++) {
+		results[i] = (PnmImage){.w = -1, .h = -1};
+		if (batch.files) {
+			batch.files[i].fd = -1;
+		}
+	}
+	if (!batch.files || !batch.ready || !batch.retry) {
+		perror(strerror(errno));
+		SHYPNM_FREE(batch.files);
+		SHYPNM_FREE(batch.ready);
+		SHYPNM_FREE(batch.retry);
+		return 0;
+	}
+
+	// With a ring, thread 0 drives it while the others decode.
+	int nthreads = SHYPNM_ThreadCount(opts->nthreads);
+	pthread_mutex_init(&batch.mutex, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+#ifdef SHYPNM_HAVE_IO_URING
+	bool uring    = SHYPNM_OpenRing(&batch.ring, batch.depth);
+	batch.reading = uring;
+	nthreads += uring;
+#endif
+
+	if (!SHYPNM_RunParallel(nthreads, SHYPNM_BatchWorker, &batch)) {
+		for (int i = 0; i < nthreads; i++) {
+			SHYPNM_BatchWorker(&batch, i);
+		}
+	}
+
+#ifdef SHYPNM_HAVE_IO_URING
+	// Buffers abandoned by a failing ring are released only once it is
+	// closed and can no longer read into them.
+	if (uring) {
+		SHYPNM_CloseRing(&batch.ring);
+		for (int i = 0; i < n; i++) {
+			SHYPNM_FREE(batch.files[i].abandoned);
+		}
+	}
+#endif
+	pthread_cond_destroy(&batch.cond);
+	pthread_mutex_destroy(&batch.mutex);
+	SHYPNM_FREE(batch.files);
+	SHYPNM_FREE(batch.ready);
+	SHYPNM_FREE(batch.retry);
+
+	for (int i = 0; i < n; i++) {
+		loaded += results[i].pix != NULL;
+	}
+	return loaded;
+}
+
+// Asynchronous loads run on a pool of worker threads, started by the first
+// load. Each worker has its own queue of jobs, which it takes from the front
+// of, and steals from the back of the others' queues when its own is empty.
+// New jobs are spread over the queues in turn. The number of workers caps the
+// number of loads decoded at once, and the total number of queued jobs is
+// limited, so that submitting a load never blocks.
+#define SHYPNM_ASYNCQUEUE 1024
+
+typedef struct {
+	uint64_t        id;
+	char *          path;
+	int             format;
+	bool            cancelled;
+	PnmLoadCallback callback;
+	void *          user;
+} SHYPNM_AsyncJob;
+
+typedef struct {
+	pthread_mutex_t   mutex;
+	SHYPNM_AsyncJob **jobs;
+	int               head;
+	int               count;
+	SHYPNM_AsyncJob * running;
+	pthread_t         thread;
+} SHYPNM_Worker;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	SHYPNM_Worker * workers;
+	int             nworkers;
+	int             maxqueued;
+	int             queued;
+	int             next;
+	uint64_t        ids;
+	bool            stopping;
+} SHYPNM_Pool;
+
+SHYPNM_Pool SHYPNM_AsyncPool = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                                .cond  = PTHREAD_COND_INITIALIZER};
+
+SHYPNM_AsyncJob *SHYPNM_WorkerTake(SHYPNM_Worker *worker, bool steal)
+{
+	// Takes the first job from the queue of worker, or the last if the job
+	// is being stolen, with the worker's mutex held.
+	SHYPNM_Pool *    pool = &SHYPNM_AsyncPool;
+	SHYPNM_AsyncJob *job;
+
+	if (!worker->count) {
+		return NULL;
+	} else if (steal) {
+		int last = (worker->head + worker->count - 1) % pool->maxqueued;
+		job      = worker->jobs[last];
+	} else {
+		job          = worker->jobs[worker->head];
+		worker->head = (worker->head + 1) % pool->maxqueued;
+	}
+
+	worker->count--;
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	return job;
+}
+
+SHYPNM_AsyncJob *SHYPNM_WorkerNext(int index)
+{
+	// Finds the next job for worker index, and marks it as running there
+	// before the mutex of the queue it came from is released, so that
+	// PnmAsyncCancel() always finds it in one place or the other.
+	SHYPNM_Pool *    pool   = &SHYPNM_AsyncPool;
+	SHYPNM_Worker *  worker = &pool->workers[index];
+	SHYPNM_AsyncJob *job    = NULL;
+
+	for (int i = 0; i < pool->nworkers && !job; i++) {
+		int            k      = (index + i) % pool->nworkers;
+		SHYPNM_Worker *victim = &pool->workers[k];
+		pthread_mutex_lock(&victim->mutex);
+		job = SHYPNM_WorkerTake(victim, i > 0);
+		if (job) {
+			__atomic_store_n(
+			    &worker->running, job, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&victim->mutex);
+	}
+
+	return job;
+}
+
+void SHYPNM_FinishJob(SHYPNM_AsyncJob *job, void *pix, int w, int h)
+{
+	job->callback(job->user, pix, w, h);
+	SHYPNM_DEFAULTFREE(job->path);
+	SHYPNM_DEFAULTFREE(job);
+}
+
+void *SHYPNM_WorkerThread(void *arg)
+{
+	SHYPNM_Pool *    pool   = &SHYPNM_AsyncPool;
+	int              index  = (int)(intptr_t)arg;
+	SHYPNM_Worker *  worker = &pool->workers[index];
+	SHYPNM_AsyncJob *job;
+
+	// Waits for the pool to finish starting, which it does with its mutex
+	// held.
+	pthread_mutex_lock(&pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (;;) {
+		job = SHYPNM_WorkerNext(index);
+		if (!job) {
+			// Sleeps until there might be work, or until the pool
+			// is stopped.
+			pthread_mutex_lock(&pool->mutex);
+			while (!__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST)
+			       && !pool->stopping) {
+				pthread_cond_wait(&pool->cond, &pool->mutex);
+			}
+			bool stop = pool->stopping;
+			pthread_mutex_unlock(&pool->mutex);
+			if (stop) {
+				return NULL;
+			}
+			continue;
+		}
+
+		PnmSource src = {.filename = job->path};
+		int       w, h;
+		void *    pix = PnmLoadEx(&src, job->format, &w, &h);
+
+		// A load cancelled while it ran is finished, but its pixels are
+		// discarded.
+		pthread_mutex_lock(&worker->mutex);
+		__atomic_store_n(&worker->running, NULL, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&worker->mutex);
+		if (__atomic_load_n(&job->cancelled, __ATOMIC_SEQ_CST)) {
+			SHYPNM_FREE(pix);
+			SHYPNM_FinishJob(job, NULL, 0, 0);
+		} else {
+			SHYPNM_FinishJob(job, pix, w, h);
+		}
+	}
+}
+
+bool SHYPNM_StartPool(const PnmAsyncOptions *opts)
+{
+	// Starts the workers, with the pool's mutex held. Workers which could
+	// not be started are left out.
+	SHYPNM_Pool *pool = &SHYPNM_AsyncPool;
+	int          n    = SHYPNM_ThreadCount(opts->nthreads);
+
+	pool->maxqueued = opts->maxqueued > 0 ? opts->maxqueued
+	                                      : SHYPNM_ASYNCQUEUE;
+	pool->workers   = SHYPNM_DEFAULTMALLOC(n * sizeof(SHYPNM_Worker));
+	if (!pool->workers) {
+		perror(strerror(errno));
+		return false;
+	}
+	memset(pool->workers, 0, n * sizeof(SHYPNM_Worker));
+
+	size_t size = pool->maxqueued * sizeof(SHYPNM_AsyncJob *);
+	for (pool->nworkers = 0; pool->nworkers < n; pool->nworkers++) {
+		SHYPNM_Worker *worker = &pool->workers[pool->nworkers];
+		worker->jobs          = SHYPNM_DEFAULTMALLOC(size);
+		if (!worker->jobs) {
+			break;
+		}
+		pthread_mutex_init(&worker->mutex, NULL);
+		if (pthread_create(&worker->thread,
+		                   NULL,
+		                   SHYPNM_WorkerThread,
+		                   (void *)(intptr_t)pool->nworkers)) {
+			pthread_mutex_destroy(&worker->mutex);
+			SHYPNM_DEFAULTFREE(worker->jobs);
+			break;
+		}
+	}
+
+	if (!pool->nworkers) {
+		fprintf(stderr, "Error starting Pnm worker threads.\n");
+		SHYPNM_DEFAULTFREE(pool->workers);
+		pool->workers = NULL;
+		return false;
+	}
+	return true;
+}
+
+uint64_t PnmLoadAsync(const char *           path,
+                      const PnmAsyncOptions *opts,
+                      PnmLoadCallback        callback,
+                      void *                 user)
+{
+	SHYPNM_Pool *   pool     = &SHYPNM_AsyncPool;
+	PnmAsyncOptions defaults = {0};
+	uint64_t        id       = 0;
+
+	opts = opts ? opts : &defaults;
+	SHYPNM_AsyncJob *job = SHYPNM_DEFAULTMALLOC(sizeof(SHYPNM_AsyncJob));
+	char *           copy = SHYPNM_DEFAULTMALLOC(strlen(path) + 1);
+	if (!job || !copy) {
+		perror(strerror(errno));
+		if (job) {
+			SHYPNM_DEFAULTFREE(job);
+		}
+		if (copy) {
+			SHYPNM_DEFAULTFREE(copy);
+		}
+		return 0;
+	}
+	strcpy(copy, path);
+
+	pthread_mutex_lock(&pool->mutex);
+	bool ok = !pool->stopping && (pool->workers || SHYPNM_StartPool(opts));
+	if (ok
+	    && __atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST)
+	           >= pool->maxqueued) {
+		fprintf(stderr, "Error queueing Pnm load; queue is full.\n");
+		ok = false;
+	}
+	if (ok) {
+		id   = ++pool->ids;
+		*job = (SHYPNM_AsyncJob){.id       = id,
+		                         .path     = copy,
+		                         .format   = opts->format,
+		                         .callback = callback,
+		                         .user     = user};
+
+		SHYPNM_Worker *worker = &pool->workers[pool->next];
+		pool->next            = (pool->next + 1) % pool->nworkers;
+		pthread_mutex_lock(&worker->mutex);
+		int tail = (worker->head + worker->count) % pool->maxqueued;
+		worker->jobs[tail] = job;
+		worker->count++;
+		__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&worker->mutex);
+		pthread_cond_signal(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (!id) {
+		SHYPNM_DEFAULTFREE(job);
+		SHYPNM_DEFAULTFREE(copy);
+	}
+	return id;
+}
+
+int PnmAsyncCancel(uint64_t id)
+{
+	SHYPNM_Pool *    pool  = &SHYPNM_AsyncPool;
+	SHYPNM_AsyncJob *job   = NULL;
+	bool             found = false;
+
+	// The queues are left alone while the pool is being shut down. Every
+	// queue is searched before the running jobs, since a job only leaves
+	// its queue once it is marked as running. Running jobs are checked with
+	// their worker's mutex held, which the worker takes before finishing
+	// them.
+	pthread_mutex_lock(&pool->mutex);
+	for (int i = 0; i < pool->nworkers && !pool->stopping && !found; i++) {
+		SHYPNM_Worker *worker = &pool->workers[i];
+		pthread_mutex_lock(&worker->mutex);
+		for (int k = 0; k < worker->count && !found; k++) {
+			int slot = (worker->head + k) % pool->maxqueued;
+			if (worker->jobs[slot]->id != id) {
+				continue;
+			}
+
+			// Closes the gap left by the job in the queue.
+			job   = worker->jobs[slot];
+			found = true;
+			for (; k < worker->count - 1; k++) {
+				int next = (slot + 1) % pool->maxqueued;
+				worker->jobs[slot] = worker->jobs[next];
+				slot               = next;
+			}
+			worker->count--;
+			__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&worker->mutex);
+	}
+	for (int i = 0; i < pool->nworkers && !pool->stopping && !found; i++) {
+		SHYPNM_Worker *worker = &pool->workers[i];
+		pthread_mutex_lock(&worker->mutex);
+		SHYPNM_AsyncJob *running =
+		    __atomic_load_n(&worker->running, __ATOMIC_SEQ_CST);
+		if (running && running->id == id) {
+			__atomic_store_n(
+			    &running->cancelled, true, __ATOMIC_SEQ_CST);
+			found = true;
+		}
+		pthread_mutex_unlock(&worker->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (job) {
+		SHYPNM_FinishJob(job, NULL, 0, 0);
+	}
+	return found;
+}
+
+void PnmAsyncShutdown(void)
+{
+	SHYPNM_Pool *pool = &SHYPNM_AsyncPool;
+
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->workers || pool->stopping) {
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+	pool->stopping = true;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	// Queued jobs are cancelled, while running ones are left to finish.
+	for (int i = 0; i < pool->nworkers; i++) {
+		SHYPNM_Worker *  worker = &pool->workers[i];
+		SHYPNM_AsyncJob *job;
+		for (;;) {
+			pthread_mutex_lock(&worker->mutex);
+			job = SHYPNM_WorkerTake(worker, false);
+			pthread_mutex_unlock(&worker->mutex);
+			if (!job) {
+				break;
+			}
+			SHYPNM_FinishJob(job, NULL, 0, 0);
+		}
+	}
+	for (int i = 0; i < pool->nworkers; i++) {
+		pthread_join(pool->workers[i].thread, NULL);
+	}
+	for (int i = 0; i < pool->nworkers; i++) {
+		pthread_mutex_destroy(&pool->workers[i].mutex);
+		SHYPNM_DEFAULTFREE(pool->workers[i].jobs);
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	SHYPNM_DEFAULTFREE(pool->workers);
+	pool->workers  = NULL;
+	pool->nworkers = 0;
+	pool->next     = 0;
+	pool->stopping = false;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+// Decoded images are cached by path and format, and checked against the
+// device, inode, modification time and size of the file on every lookup. The
+// table is split into shards by the hash of the key, each with its own lock,
+// buckets and list of entries from most to least recently used. Each image is
+// held in one block after its entry, and freed once it is both out of the
+// cache and no longer referenced. The total size of the cached images is kept
+// within the budget by evicting the least recently used unreferenced images,
+// starting with the shard of the newest image.
+#define SHYPNM_CACHESHARDS  16
+#define SHYPNM_CACHEBUCKETS 256
+#define SHYPNM_CACHEBUDGET  ((size_t)64 << 20)
+
+// Modification times are compared to the nanosecond where struct stat has
+// them, so that a file rewritten within a second is still noticed. Headers
+// which declare the timespec members define st_mtime as a macro for them,
+// while glibc and Darwin name the nanoseconds st_mtimensec otherwise.
+#if defined(st_mtime) && defined(__APPLE__)
+#define SHYPNM_MTIMENSEC(st) ((st)->st_mtimespec.tv_nsec)
+#elif defined(st_mtime)
+#define SHYPNM_MTIMENSEC(st) ((st)->st_mtim.tv_nsec)
+#elif defined(__GLIBC__) || defined(__APPLE__)
+#define SHYPNM_MTIMENSEC(st) ((long)(st)->st_mtimensec)
+#else
+#define SHYPNM_MTIMENSEC(st) 0
+#endif
+
+typedef struct SHYPNM_CacheEntry {
+	struct SHYPNM_CacheEntry *next;
+	struct SHYPNM_CacheEntry *newer;
+	struct SHYPNM_CacheEntry *older;
+	uint64_t                  hash;
+	const char *              path;
+	dev_t                     dev;
+	ino_t                     ino;
+	time_t                    mtime;
+	long                      mtime_ns;
+	off_t                     size;
+	int                       format;
+	int                       w;
+	int                       h;
+	int                       refs;
+	bool                      cached;
+	size_t                    bytes;
+} SHYPNM_CacheEntry;
+
+// Pixels start at the first multiple of 64 bytes after the entry.
+#define SHYPNM_CACHEHEADER ((sizeof(SHYPNM_CacheEntry) + 63) & ~(size_t)63)
+
+typedef struct {
+	pthread_mutex_t    mutex;
+	SHYPNM_CacheEntry *buckets[SHYPNM_CACHEBUCKETS];
+	SHYPNM_CacheEntry *newest;
+	SHYPNM_CacheEntry *oldest;
+} SHYPNM_CacheShard;
+
+SHYPNM_CacheShard SHYPNM_Cache[SHYPNM_CACHESHARDS];
+pthread_once_t    SHYPNM_CacheOnce   = PTHREAD_ONCE_INIT;
+size_t            SHYPNM_CacheBudget = SHYPNM_CACHEBUDGET;
+size_t            SHYPNM_CacheBytes;
+
+void SHYPNM_CacheInit(void)
+{
+	for (int i = 0; i < SHYPNM_CACHESHARDS; i++) {
+		pthread_mutex_init(&SHYPNM_Cache[i].mutex, NULL);
+	}
+}
+
+uint64_t SHYPNM_CacheHash(const char *path, int format)
+{
+	// 64-bit FNV-1a of the path and format.
+	uint64_t hash = 0xcbf29ce484222325;
+	for (const char *c = path; *c; c++) {
+		hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
+	}
+	return (hash ^ (uint8_t)format) * 0x100000001b3;
+}
+
+SHYPNM_CacheShard *SHYPNM_CacheShardOf(uint64_t hash)
+{
+	return &SHYPNM_Cache[(hash >> 32) % SHYPNM_CACHESHARDS];
+}
+
+SHYPNM_CacheEntry *SHYPNM_CacheEntryOf(const void *pix)
+{
+	return (SHYPNM_CacheEntry *)((uint8_t *)pix - SHYPNM_CACHEHEADER);
+}
+
+void SHYPNM_CacheUnlist(SHYPNM_CacheShard *shard, SHYPNM_CacheEntry *entry)
+{
+	// Takes an entry off the shard's list, with the shard's mutex held.
+	if (entry->newer) {
+		entry->newer->older = entry->older;
+	} else {
+		shard->newest = entry->older;
+	}
+	if (entry->older) {
+		entry->older->newer = entry->newer;
+	} else {
+		shard->oldest = entry->newer;
+	}
+}
+
+void SHYPNM_CacheList(SHYPNM_CacheShard *shard, SHYPNM_CacheEntry *entry)
+{
+	// Puts an entry at the front of the shard's list, with its mutex held.
+	entry->newer = NULL;
+	entry->older = shard->newest;
+	if (shard->newest) {
+		shard->newest->newer = entry;
+	} else {
+		shard->oldest = entry;
+	}
+	shard->newest = entry;
+}
+
+bool SHYPNM_CacheRemove(SHYPNM_CacheShard *shard, SHYPNM_CacheEntry *entry)
+{
+	// Removes an entry from the cache, with the shard's mutex held. Returns
+	// true if it is unreferenced, and should be freed by the caller once
+	// the mutex is released.
+	SHYPNM_CacheEntry **link
+	    = &shard->buckets[entry->hash % SHYPNM_CACHEBUCKETS];
+	while (*link != entry) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+
+	SHYPNM_CacheUnlist(shard, entry);
+	entry->cached = false;
+	__atomic_sub_fetch(&SHYPNM_CacheBytes, entry->bytes, __ATOMIC_SEQ_CST);
+	return !entry->refs;
+}
+
+void SHYPNM_CacheTrim(SHYPNM_CacheShard *first)
+{
+	// Evicts unreferenced entries until the cache is within its budget,
+	// or until every shard has been searched without finding any.
+	int i = first - SHYPNM_Cache;
+
+	for (int idle = 0; idle < SHYPNM_CACHESHARDS;) {
+		if (__atomic_load_n(&SHYPNM_CacheBytes, __ATOMIC_SEQ_CST)
+		    <= __atomic_load_n(&SHYPNM_CacheBudget, __ATOMIC_SEQ_CST)) {
+			return;
+		}
+
+		SHYPNM_CacheShard *shard  = &SHYPNM_Cache[i];
+		SHYPNM_CacheEntry *victim;
+		pthread_mutex_lock(&shard->mutex);
+		victim = shard->oldest;
+		while (victim && victim->refs) {
+			victim = victim->newer;
+		}
+		if (victim) {
+			SHYPNM_CacheRemove(shard, victim);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		if (victim) {
+			SHYPNM_DEFAULTFREE(victim);
+			idle = 0;
+		} else {
+			idle++;
+			i = (i + 1) % SHYPNM_CACHESHARDS;
+		}
+	}
+}
+
+SHYPNM_CacheEntry *SHYPNM_CacheFind(SHYPNM_CacheShard *shard,
+                                    uint64_t           hash,
+                                    const char *       path,
+                                    int                format,
+                                    struct stat *      st,
+                                    SHYPNM_CacheEntry **stale)
+{
+	// Finds the entry of a file, with the shard's mutex held, and takes a
+	// reference to it. An entry for an older version of the file is
+	// removed, and returned in stale if it should be freed.
+	SHYPNM_CacheEntry *entry = shard->buckets[hash % SHYPNM_CACHEBUCKETS];
+	for (; entry; entry = entry->next) {
+		if (entry->hash == hash && entry->format == format
+		    && !strcmp(entry->path, path)) {
+			break;
+		}
+	}
+	if (!entry) {
+		return NULL;
+	} else if (entry->dev != st->st_dev || entry->ino != st->st_ino
+	           || entry->mtime != st->st_mtime
+	           || entry->mtime_ns != SHYPNM_MTIMENSEC(st)
+	           || entry->size != st->st_size) {
+		if (SHYPNM_CacheRemove(shard, entry)) {
+			*stale = entry;
+		}
+		return NULL;
+	}
+
+	SHYPNM_CacheUnlist(shard, entry);
+	SHYPNM_CacheList(shard, entry);
+	entry->refs++;
+	return entry;
+}
+
+SHYPNM_CacheEntry *SHYPNM_CacheDecode(FILE *             f,
+                                      const char *       path,
+                                      int                format,
+                                      uint64_t           hash,
+                                      const struct stat *st)
+{
+	// Decodes an image into a new entry, followed by a copy of its path.
+	SHYPNM_Source    src = SHYPNM_FileSource(f);
+	SHYPNM_Header    hdr;
+	SHYPNM_RowReader rd;
+	if (!SHYPNM_ParseHeader(&src, path, &hdr)
+	    || !SHYPNM_OpenRows(&rd, &src, &hdr)) {
+		return NULL;
+	}
+
+	size_t             row   = SHYPNM_FormatRowSize(format, hdr.w);
+	size_t             bytes = row * hdr.h;
+	size_t             len   = strlen(path) + 1;
+	SHYPNM_CacheEntry *entry
+	    = SHYPNM_DEFAULTMALLOC(SHYPNM_CACHEHEADER + bytes + len);
+	if (!entry) {
+		perror(strerror(errno));
+		SHYPNM_CloseRows(&rd);
+		return NULL;
+	}
+
+	uint8_t *pix  = (uint8_t *)entry + SHYPNM_CACHEHEADER;
+	char *   copy = memcpy(pix + bytes, path, len);
+	*entry        = (SHYPNM_CacheEntry){.hash     = hash,
+	                                    .path     = copy,
+	                                    .dev      = st->st_dev,
+	                                    .ino      = st->st_ino,
+	                                    .mtime    = st->st_mtime,
+	                                    .mtime_ns = SHYPNM_MTIMENSEC(st),
+	                                    .size     = st->st_size,
+	                                    .format   = format,
+	                                    .w        = hdr.w,
+	                                    .h        = hdr.h,
+	                                    .refs     = 1,
+	                                    .bytes    = bytes};
+	if (!SHYPNM_DecodeInto(&rd, pix, row, format)) {
+		SHYPNM_DEFAULTFREE(entry);
+		entry = NULL;
+	}
+
+	SHYPNM_CloseRows(&rd);
+	return entry;
+}
+
+const void *PnmCacheLoad(const char *filename, int format, int *w, int *h)
+{
+	*w = -1;
+	*h = -1;
+	if (format < PNM_RGBA32 || format > PNM_BIT1) {
+		fprintf(stderr, "Error loading Pnm file; unknown format.\n");
+		return NULL;
+	}
+
+	// Cached images are found by the status of the path, but a new image is
+	// keyed by the status of the descriptor it is decoded from, so that the
+	// key always matches the pixels.
+	pthread_once(&SHYPNM_CacheOnce, SHYPNM_CacheInit);
+	uint64_t           hash    = SHYPNM_CacheHash(filename, format);
+	SHYPNM_CacheShard *shard   = SHYPNM_CacheShardOf(hash);
+	SHYPNM_CacheEntry *stale   = NULL;
+	SHYPNM_CacheEntry *decoded = NULL;
+	SHYPNM_CacheEntry *entry   = NULL;
+	struct stat        st;
+
+	if (!stat(filename, &st)) {
+		pthread_mutex_lock(&shard->mutex);
+		entry = SHYPNM_CacheFind(
+		    shard, hash, filename, format, &st, &stale);
+		pthread_mutex_unlock(&shard->mutex);
+		if (stale) {
+			SHYPNM_DEFAULTFREE(stale);
+			stale = NULL;
+		}
+	}
+	if (entry) {
+		*w = entry->w;
+		*h = entry->h;
+		return (uint8_t *)entry + SHYPNM_CACHEHEADER;
+	}
+
+	FILE *f = SHYPNM_OpenFile(filename);
+	if (!f) {
+		return NULL;
+	} else if (fstat(fileno(f), &st)) {
+		fprintf(stderr, "Error opening file '%s'.\n", filename);
+		fclose(f);
+		return NULL;
+	}
+	decoded = SHYPNM_CacheDecode(f, filename, format, hash, &st);
+	fclose(f);
+
+	// A new image is cached unless another thread got there first while it
+	// was decoded, in which case the other image is used instead.
+	if (decoded) {
+		pthread_mutex_lock(&shard->mutex);
+		entry = SHYPNM_CacheFind(
+		    shard, hash, filename, format, &st, &stale);
+		if (!entry) {
+			SHYPNM_CacheEntry **bucket
+			    = &shard->buckets[hash % SHYPNM_CACHEBUCKETS];
+			entry         = decoded;
+			entry->next   = *bucket;
+			entry->cached = true;
+			*bucket       = entry;
+			decoded       = NULL;
+			SHYPNM_CacheList(shard, entry);
+			__atomic_add_fetch(
+			    &SHYPNM_CacheBytes, entry->bytes, __ATOMIC_SEQ_CST);
+		}
+		pthread_mutex_unlock(&shard->mutex);
+		if (decoded) {
+			SHYPNM_DEFAULTFREE(decoded);
+		}
+		if (stale) {
+			SHYPNM_DEFAULTFREE(stale);
+		}
+		SHYPNM_CacheTrim(shard);
+	}
+	if (!entry) {
+		return NULL;
+	}
+
+	*w = entry->w;
+	*h = entry->h;
+	return (uint8_t *)entry + SHYPNM_CACHEHEADER;
+}
+
+void PnmCacheRelease(const void *pix)
+{
+	if (!pix) {
+		return;
+	}
+
+	SHYPNM_CacheEntry *entry = SHYPNM_CacheEntryOf(pix);
+	SHYPNM_CacheShard *shard = SHYPNM_CacheShardOf(entry->hash);
+
+	pthread_mutex_lock(&shard->mutex);
+	bool unused = !--entry->refs;
+	bool cached = entry->cached;
+	pthread_mutex_unlock(&shard->mutex);
+
+	// Images left over the budget while they were in use are evicted
+	// once released.
+	if (unused && !cached) {
+		SHYPNM_DEFAULTFREE(entry);
+	} else if (unused) {
+		SHYPNM_CacheTrim(shard);
+	}
+}
+
+void PnmCacheSetBudget(size_t bytes)
+{
+	pthread_once(&SHYPNM_CacheOnce, SHYPNM_CacheInit);
+	__atomic_store_n(&SHYPNM_CacheBudget, bytes, __ATOMIC_SEQ_CST);
+	SHYPNM_CacheTrim(SHYPNM_Cache);
+}
+
+void PnmCacheClear(void)
+{
+	// Entries still in use are freed when they are released.
+	pthread_once(&SHYPNM_CacheOnce, SHYPNM_CacheInit);
+	for (int i = 0; i < SHYPNM_CACHESHARDS; i++) {
+		SHYPNM_CacheShard *shard  = &SHYPNM_Cache[i];
+		SHYPNM_CacheEntry *unused = NULL;
+
+		pthread_mutex_lock(&shard->mutex);
+		while (shard->oldest) {
+			SHYPNM_CacheEntry *entry = shard->oldest;
+			if (SHYPNM_CacheRemove(shard, entry)) {
+				entry->next = unused;
+				unused      = entry;
+			}
+		}
+		pthread_mutex_unlock(&shard->mutex);
+
+		while (unused) {
+			SHYPNM_CacheEntry *next = unused->next;
+			SHYPNM_DEFAULTFREE(unused);
+			unused = next;
+		}
+	}
+}
+
+#else
+
+uint32_t *PnmLoadParallel(const char *filename, int *w, int *h, int nthreads)
+{
+	// Threads are unavailable on this platform, so fall back to regular
+	// serial loading.
+	(void)nthreads;
+	return PnmLoad(filename, w, h);
+}
+
+int PnmLoadBatch(const char *const *    paths,
+                 int                    n,
+                 PnmImage *             results,
+                 const PnmBatchOptions *opts)
+{
+	// Without threads, files are simply loaded one after another.
+	int loaded = 0;
+
+	for (int i = 0; i < n; i++) {
+		PnmSource src    = {.filename = paths[i]};
+		PnmImage *res    = &results[i];
+		int       format = opts ? opts->format : PNM_RGBA32;
+
+		res->pix = PnmLoadEx(&src, format, &res->w, &res->h);
+		loaded += res->pix != NULL;
+	}
+	return loaded;
+}
+
+uint64_t SHYPNM_AsyncIds;
+
+uint64_t PnmLoadAsync(const char *           path,
+                      const PnmAsyncOptions *opts,
+                      PnmLoadCallback        callback,
+                      void *                 user)
+{
+	// Without threads, loads are finished before they are returned.
+	PnmSource src    = {.filename = path};
+	int       format = opts ? opts->format : PNM_RGBA32;
+	int       w, h;
+	void *    pix = PnmLoadEx(&src, format, &w, &h);
+
+	callback(user, pix, w, h);
+	return ++SHYPNM_AsyncIds;
+}
+
+int PnmAsyncCancel(uint64_t id)
+{
+	(void)id;
+	return 0;
+}
+
+void PnmAsyncShutdown(void)
+{
+}
+
+const void *PnmCacheLoad(const char *filename, int format, int *w, int *h)
+{
+	// Without threads the cache is left out, and images are loaded anew
+	// every time.
+	PnmSource src = {.filename = filename};
+	return PnmLoadEx(&src, format, w, h);
+}
+
+void PnmCacheRelease(const void *pix)
+{
+	PnmFree((void *)pix);
+}
+
+void PnmCacheSetBudget(size_t bytes)
+{
+	(void)bytes;
+}
+
+void PnmCacheClear(void)
+{
+}
+
+#endif
 
 #undef SHY_PNM_IMPLEMENTATION
 
@@ -0,0 +1,616 @@
+/*
+Shy PNM benchmark -- decoding throughput of shy_pnm.h
+
+USAGE:
+        Build and run with
+
+        cc -O2 -o shy_pnm_bench shy_pnm_bench.c -lpthread
+        ./shy_pnm_bench [-t seconds] [-d dir] [-o file] [-b file]
+                        [-r percent] [filter]
+
+        A corpus of images is generated in memory and written to a new
+        directory in dir (default /tmp), which is removed afterwards. The
+        images are the same on every run: PBM, PGM and PPM images in plain
+        and binary form, and PAM images of depths 1 to 4, at 64x64 and
+        1920x1080 pixels, with maxvals of 1, 255, 256, 1023 and 65535 where
+        the format allows, and binary images whose headers hold hundreds of
+        comments.
+
+        Each image is decoded by each loader of shy_pnm.h:
+
+        memory          PnmLoadMemory()
+        file            PnmLoad()
+        mapped          PnmLoadMapped()
+        parallel        PnmLoadParallel(), with one thread per processor
+        native          PnmLoadEx() from memory, into the 8 or 16-bit
+                        format closest to the image
+        push            PnmDecoderFeed() with 64kB pieces of the file
+
+        for at least the given number of seconds (default 0.1) and three
+        times, and the best time is reported as MB/s of file and millions
+        of pixels per second. Only images or loaders whose names contain
+        filter are run.
+
+        The results are saved to file with -o, and compared to those saved
+        in a baseline file with -b. Results slower than the baseline by
+        more than percent (default 10) are marked as regressions, in which
+        case the program exits with status 1.
+
+LICENSE:
+        This program is in the public domain, no rights reserved. See full
+        unlicense text at the end of this file for more detailed information.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#define SHY_PNM_IMPLEMENTATION
+#include "shy_pnm.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_COMMENTS 256
+#define BENCH_PUSHSIZE (1 << 16)
+#define BENCH_NAMEMAX  64
+
+typedef struct {
+	uint8_t *data;
+	size_t   size;
+	size_t   cap;
+} BenchBuffer;
+
+typedef struct {
+	char     name[BENCH_NAMEMAX];
+	char     path[BENCH_NAMEMAX * 4];
+	uint8_t *data;
+	size_t   size;
+	int      format;
+} BenchImage;
+
+typedef struct {
+	const char *name;
+	void *(*load)(const BenchImage *img, int *w, int *h);
+} BenchLoader;
+
+typedef struct {
+	char   image[BENCH_NAMEMAX];
+	char   loader[BENCH_NAMEMAX];
+	double mbps;
+	double mpps;
+} BenchResult;
+
+// Images are generated from a xorshift generator seeded by their names, so
+// that every run decodes exactly the same bytes.
+uint64_t BenchSeed(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (const char *c = name; *c; c++) {
+		hash = (hash ^ (uint8_t)*c) * 0x100000001b3;
+	}
+	return hash ? hash : 1;
+}
+
+uint64_t BenchRandom(uint64_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+void BenchPut(BenchBuffer *buf, const void *data, size_t size)
+{
+	if (buf->size + size > buf->cap) {
+		buf->cap  = (buf->size + size) * 2;
+		buf->data = realloc(buf->data, buf->cap);
+		if (!buf->data) {
+			perror(strerror(errno));
+			exit(1);
+		}
+	}
+	memcpy(buf->data + buf->size, data, size);
+	buf->size += size;
+}
+
+void BenchPrint(BenchBuffer *buf, const char *fmt, ...)
+{
+	char    text[256];
+	va_list args;
+
+	va_start(args, fmt);
+	int len = vsnprintf(text, sizeof(text), fmt, args);
+	va_end(args);
+	BenchPut(buf, text, len);
+}
+
+void BenchComments(BenchBuffer *buf, bool comments)
+{
+	// Separates two header tokens, with a block of comments if asked to.
+	BenchPut(buf, "\n", 1);
+	for (int i = 0; comments && i < BENCH_COMMENTS; i++) {
+		BenchPrint(buf, "# comment %d of a comment-heavy header\n", i);
+	}
+}
+
+void BenchHeader(BenchBuffer *buf,
+                 int          magic,
+                 int          w,
+                 int          h,
+                 int          depth,
+                 int          maxval,
+                 bool         comments)
+{
+	static const char *tupltypes[]
+	    = {"GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"};
+
+	if (magic == '7') {
+		BenchPrint(buf, "P7");
+		BenchComments(buf, comments);
+		BenchPrint(buf, "WIDTH %d\nHEIGHT %d\nDEPTH %d\n", w, h, depth);
+		BenchPrint(buf, "MAXVAL %d", maxval);
+		BenchComments(buf, comments);
+		BenchPrint(buf, "TUPLTYPE %s\nENDHDR\n", tupltypes[depth - 1]);
+		return;
+	}
+
+	BenchPrint(buf, "P%c", magic);
+	BenchComments(buf, comments);
+	BenchPrint(buf, "%d %d", w, h);
+	if (magic != '1' && magic != '4') {
+		BenchComments(buf, comments);
+		BenchPrint(buf, "%d", maxval);
+	}
+	BenchPut(buf, "\n", 1);
+}
+
+void BenchRaster(BenchBuffer *buf,
+                 uint64_t *   state,
+                 int          magic,
+                 int          w,
+                 int          h,
+                 int          depth,
+                 int          maxval)
+{
+	if (magic == '4') {
+		size_t row = (w + 7) / 8;
+		for (size_t i = 0; i < row * h; i++) {
+			uint8_t byte = BenchRandom(state);
+			BenchPut(buf, &byte, 1);
+		}
+		return;
+	}
+
+	// Plain samples are written in lines of about 70 characters.
+	bool   plain = magic <= '3';
+	size_t count = (size_t)w * h * depth;
+	int    line  = 0;
+	for (size_t i = 0; i < count; i++) {
+		unsigned value = BenchRandom(state) % ((unsigned)maxval + 1);
+		if (plain) {
+			char text[12];
+			int  len = sprintf(text, "%u", value);
+			if (line + len >= 70) {
+				BenchPut(buf, "\n", 1);
+				line = 0;
+			} else if (line) {
+				BenchPut(buf, " ", 1);
+				line++;
+			}
+			BenchPut(buf, text, len);
+			line += len;
+		} else if (maxval > 255) {
+			uint8_t bytes[2] = {value >> 8, value & 0xff};
+			BenchPut(buf, bytes, 2);
+		} else {
+			uint8_t byte = value;
+			BenchPut(buf, &byte, 1);
+		}
+	}
+	BenchPut(buf, "\n", 1);
+}
+
+int BenchNativeFormat(int magic, int depth, int maxval)
+{
+	static const int formats[2][4] = {
+	    {PNM_GRAY8, PNM_RGBA8, PNM_RGB8, PNM_RGBA8},
+	    {PNM_GRAY16, PNM_RGBA16, PNM_RGB16, PNM_RGBA16},
+	};
+
+	if (magic == '1' || magic == '4') {
+		return PNM_BIT1;
+	}
+	return formats[maxval > 255][depth - 1];
+}
+
+void BenchAdd(BenchImage **images,
+              int *        n,
+              const char * dir,
+              int          magic,
+              int          w,
+              int          h,
+              int          depth,
+              int          maxval,
+              bool         comments)
+{
+	BenchImage  img = {0};
+	BenchBuffer buf = {0};
+
+	if (magic == '7') {
+		snprintf(img.name,
+		         sizeof(img.name),
+		         "p7d%d_%dx%d_%d%s",
+		         depth,
+		         w,
+		         h,
+		         maxval,
+		         comments ? "_comments" : "");
+	} else {
+		snprintf(img.name,
+		         sizeof(img.name),
+		         "p%c_%dx%d_%d%s",
+		         magic,
+		         w,
+		         h,
+		         maxval,
+		         comments ? "_comments" : "");
+	}
+
+	uint64_t state = BenchSeed(img.name);
+	BenchHeader(&buf, magic, w, h, depth, maxval, comments);
+	BenchRaster(&buf, &state, magic, w, h, depth, maxval);
+	img.data   = buf.data;
+	img.size   = buf.size;
+	img.format = BenchNativeFormat(magic, depth, maxval);
+
+	snprintf(img.path, sizeof(img.path), "%s/%s.pnm", dir, img.name);
+	FILE *f = fopen(img.path, "wb");
+	if (!f || fwrite(img.data, 1, img.size, f) != img.size) {
+		fprintf(stderr, "Error writing file '%s'.\n", img.path);
+		exit(1);
+	}
+	fclose(f);
+
+	*images = realloc(*images, (*n + 1) * sizeof(BenchImage));
+	if (!*images) {
+		perror(strerror(errno));
+		exit(1);
+	}
+	(*images)[(*n)++] = img;
+}
+
+int BenchCorpus(BenchImage **images, const char *dir)
+{
+	static const int sizes[][2] = {{64, 64}, {1920, 1080}};
+	static const int maxvals[]  = {1, 255, 256, 1023, 65535};
+	static const int magics[]   = {'2', '3', '5', '6'};
+	static const int nsizes     = sizeof(sizes) / sizeof(sizes[0]);
+	static const int nmaxvals   = sizeof(maxvals) / sizeof(maxvals[0]);
+	static const int nmagics    = sizeof(magics) / sizeof(magics[0]);
+	int              n          = 0;
+
+	for (int s = 0; s < nsizes; s++) {
+		int w = sizes[s][0];
+		int h = sizes[s][1];
+
+		BenchAdd(images, &n, dir, '1', w, h, 1, 1, false);
+		BenchAdd(images, &n, dir, '4', w, h, 1, 1, false);
+		for (int m = 0; m < nmagics; m++) {
+			int magic = magics[m];
+			int depth = magic == '3' || magic == '6' ? 3 : 1;
+			for (int v = 0; v < nmaxvals; v++) {
+				BenchAdd(images,
+				         &n,
+				         dir,
+				         magic,
+				         w,
+				         h,
+				         depth,
+				         maxvals[v],
+				         false);
+			}
+		}
+		for (int depth = 1; depth <= 4; depth++) {
+			for (int v = 0; v < nmaxvals; v++) {
+				BenchAdd(images,
+				         &n,
+				         dir,
+				         '7',
+				         w,
+				         h,
+				         depth,
+				         maxvals[v],
+				         false);
+			}
+		}
+		BenchAdd(images, &n, dir, '4', w, h, 1, 1, true);
+		BenchAdd(images, &n, dir, '5', w, h, 1, 255, true);
+		BenchAdd(images, &n, dir, '6', w, h, 3, 65535, true);
+		BenchAdd(images, &n, dir, '7', w, h, 4, 255, true);
+	}
+
+	return n;
+}
+
+void *BenchMemory(const BenchImage *img, int *w, int *h)
+{
+	return PnmLoadMemory(img->data, img->size, w, h);
+}
+
+void *BenchFile(const BenchImage *img, int *w, int *h)
+{
+	return PnmLoad(img->path, w, h);
+}
+
+void *BenchMapped(const BenchImage *img, int *w, int *h)
+{
+	return PnmLoadMapped(img->path, w, h);
+}
+
+void *BenchParallel(const BenchImage *img, int *w, int *h)
+{
+	return PnmLoadParallel(img->path, w, h, 0);
+}
+
+void *BenchNative(const BenchImage *img, int *w, int *h)
+{
+	PnmSource source = {.data = img->data, .size = img->size};
+	return PnmLoadEx(&source, img->format, w, h);
+}
+
+void *BenchPush(const BenchImage *img, int *w, int *h)
+{
+	PnmDecoder *dec = PnmDecoderCreate();
+	for (size_t at = 0; dec && at < img->size; at += BENCH_PUSHSIZE) {
+		size_t len = img->size - at;
+		if (len > BENCH_PUSHSIZE) {
+			len = BENCH_PUSHSIZE;
+		}
+		if (PnmDecoderFeed(dec, img->data + at, len) < 0) {
+			break;
+		}
+	}
+	return dec ? PnmDecoderFinish(dec, w, h) : NULL;
+}
+
+double BenchNow(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool BenchRun(const BenchImage * img,
+              const BenchLoader *loader,
+              double             seconds,
+              BenchResult *      result)
+{
+	// Keeps the fastest of at least three loads, for at least the given
+	// number of seconds in all.
+	double best  = 0;
+	double start = BenchNow();
+	int    w, h;
+
+	for (int runs = 0; runs < 3 || BenchNow() - start < seconds; runs++) {
+		double t   = BenchNow();
+		void * pix = loader->load(img, &w, &h);
+		t          = BenchNow() - t;
+		if (!pix) {
+			fprintf(stderr,
+			        "Error loading image '%s' with %s.\n",
+			        img->name,
+			        loader->name);
+			return false;
+		}
+		PnmFree(pix);
+		if (!runs || t < best) {
+			best = t;
+		}
+	}
+
+	snprintf(result->image, sizeof(result->image), "%s", img->name);
+	snprintf(result->loader, sizeof(result->loader), "%s", loader->name);
+	result->mbps = img->size / best / 1e6;
+	result->mpps = (double)w * h / best / 1e6;
+	return true;
+}
+
+int BenchLoadBaseline(const char *filename, BenchResult **results)
+{
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "Error opening file '%s'.\n", filename);
+		exit(1);
+	}
+
+	BenchResult r;
+	int         n = 0;
+	while (fscanf(f, "%63s %63s %lf", r.image, r.loader, &r.mbps) == 3
+	       && fscanf(f, "%lf", &r.mpps) == 1) {
+		*results = realloc(*results, (n + 1) * sizeof(BenchResult));
+		if (!*results) {
+			perror(strerror(errno));
+			exit(1);
+		}
+		(*results)[n++] = r;
+	}
+
+	fclose(f);
+	return n;
+}
+
+const BenchResult *BenchFind(const BenchResult *results,
+                             int                n,
+                             const BenchResult *result)
+{
+	for (int i = 0; i < n; i++) {
+		if (!strcmp(results[i].image, result->image)
+		    && !strcmp(results[i].loader, result->loader)) {
+			return &results[i];
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	static const BenchLoader loaders[] = {
+	    {"memory", BenchMemory},
+	    {"file", BenchFile},
+	    {"mapped", BenchMapped},
+	    {"parallel", BenchParallel},
+	    {"native", BenchNative},
+	    {"push", BenchPush},
+	};
+	static const int nloaders = sizeof(loaders) / sizeof(loaders[0]);
+
+	double      seconds   = 0.1;
+	double      threshold = 10;
+	const char *tmpdir    = "/tmp";
+	const char *output    = NULL;
+	const char *baseline  = NULL;
+	const char *filter    = "";
+	int         opt;
+
+	while ((opt = getopt(argc, argv, "t:d:o:b:r:")) != -1) {
+		switch (opt) {
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'd':
+			tmpdir = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 'r':
+			threshold = atof(optarg);
+			break;
+		default:
+			fprintf(stderr,
+			        "usage: %s [-t seconds] [-d dir] [-o file] "
+			        "[-b file] [-r percent] [filter]\n",
+			        argv[0]);
+			return 2;
+		}
+	}
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+
+	BenchResult *base  = NULL;
+	int          nbase = baseline ? BenchLoadBaseline(baseline, &base) : 0;
+	FILE *       out   = output ? fopen(output, "w") : NULL;
+	if (output && !out) {
+		fprintf(stderr, "Error opening file '%s'.\n", output);
+		return 1;
+	}
+
+	char dir[BENCH_NAMEMAX * 2];
+	snprintf(dir, sizeof(dir), "%s/shy_pnm_bench_XXXXXX", tmpdir);
+	if (!mkdtemp(dir)) {
+		fprintf(stderr, "Error creating directory in '%s'.\n", tmpdir);
+		return 1;
+	}
+
+	BenchImage *images  = NULL;
+	int         nimages = BenchCorpus(&images, dir);
+	int         slower  = 0;
+	bool        ok      = true;
+
+	printf("%-28s %-9s %10s %10s", "image", "loader", "MB/s", "Mpixel/s");
+	printf(nbase ? " %10s\n" : "\n", "change");
+	for (int i = 0; i < nimages; i++) {
+		for (int l = 0; l < nloaders; l++) {
+			const BenchImage * img    = &images[i];
+			const BenchLoader *loader = &loaders[l];
+			BenchResult        r;
+			if (!strstr(img->name, filter)
+			    && !strstr(loader->name, filter)) {
+				continue;
+			} else if (!BenchRun(img, loader, seconds, &r)) {
+				ok = false;
+				continue;
+			}
+
+			printf("%-28s %-9s %10.1f %10.1f",
+			       r.image,
+			       r.loader,
+			       r.mbps,
+			       r.mpps);
+			if (out) {
+				fprintf(out,
+				        "%s %s %.3f %.3f\n",
+				        r.image,
+				        r.loader,
+				        r.mbps,
+				        r.mpps);
+			}
+
+			const BenchResult *b = BenchFind(base, nbase, &r);
+			if (b) {
+				double change = (r.mpps / b->mpps - 1) * 100;
+				bool   worse  = change < -threshold;
+				printf(" %+9.1f%%", change);
+				if (worse) {
+					printf(" REGRESSION");
+				}
+				slower += worse;
+			}
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+
+	for (int i = 0; i < nimages; i++) {
+		remove(images[i].path);
+		free(images[i].data);
+	}
+	rmdir(dir);
+	free(images);
+	free(base);
+	if (out) {
+		fclose(out);
+	}
+
+	if (nbase) {
+		printf("%d regression%s over %.0f%%.\n",
+		       slower,
+		       slower == 1 ? "" : "s",
+		       threshold);
+	}
+	return !ok || slower;
+}
+
+/*
+This is free and unencumbered software released into the public domain.
+
+Anyone is free to copy, modify, publish, use, compile, sell, or distribute this
+software, either in source code form or as a compiled binary, for any purpose,
+commercial or non-commercial, and by any means.
+
+In jurisdictions that recognize copyright laws, the author or authors of this
+software dedicate any and all copyright interest in the software to the public
+domain. We make this dedication for the benefit of the public at large and to
+the detriment of our heirs and successors. We intend this dedication to be an
+overt act of relinquishment in perpetuity of all present and future rights to
+this software under copyright law.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS BE
+LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+For more information, please refer to <https://unlicense.org>
+*/
@@ -11,9 +11,30 @@ AUTHOR: Auul, 2023
 
 USAGE:
         In ONE file where this header will be included, add
-                #define SHY_PNM_IMPLEMENTATION
+                #define SHY_STR_IMPLEMENTATION
         *before* including the header file
 
+        Strings are allocated with malloc() and realloc() and should be
+        released with StrFree(). Another allocator can be used by defining
+        all three of
+
+                #define SHY_MALLOC(size) ...
+                #define SHY_REALLOC(ptr, size) ...
+                #define SHY_FREE(ptr) ...
+
+        before the implementation is included, or at runtime with
+
+        ShyAllocator allocator = {alloc, resize, release, ctx};
+        StrSetAllocator(&allocator);
+
+        after which memory is allocated as alloc(ctx, size), grown as
+        resize(ctx, ptr, size) and released as release(ctx, ptr), until
+        StrSetAllocator(NULL) restores the default. alloc and release must
+        both be set, or the allocator is rejected and the current one kept;
+        resize may be NULL, in which case strings are grown with alloc and
+        release. Strings should not be appended to or freed after the
+        allocator they came from is changed.
+
 
 LICENSE:
         This library is in the public domain, no rights reserved. See full
@@ -25,6 +46,17 @@ LICENSE:
 
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+#ifndef SHY_ALLOCATOR_DEFINED
+#define SHY_ALLOCATOR_DEFINED
+typedef struct {
+	void *(*alloc)(void *ctx, size_t size);
+	void *(*resize)(void *ctx, void *ptr, size_t size);
+	void (*release)(void *ctx, void *ptr);
+	void *ctx;
+} ShyAllocator;
+#endif
 
 // Creates a new dynamically allocated string according to the standard
 // sprintf() formatting
@@ -34,15 +66,34 @@ char *StrCreate(const char *fmt, ...);
 // it
 bool StrAppend(char **dest_p, const char *fmt, ...);
 
+// Frees a string created by StrCreate() or StrAppend()
+void StrFree(char *str);
+
+// Sets the allocator used for strings, or restores the default if allocator is
+// NULL
+void StrSetAllocator(const ShyAllocator *allocator);
+
 #ifdef SHY_STR_IMPLEMENTATION
 
 #include <errno.h>
-#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(SHY_MALLOC) || defined(SHY_REALLOC) || defined(SHY_FREE)
+#if !defined(SHY_MALLOC) || !defined(SHY_REALLOC) || !defined(SHY_FREE)
+#error "SHY_MALLOC, SHY_REALLOC and SHY_FREE must be defined together"
+#endif
+#define SHYSTR_DEFAULTMALLOC(size)       SHY_MALLOC(size)
+#define SHYSTR_DEFAULTREALLOC(ptr, size) SHY_REALLOC(ptr, size)
+#define SHYSTR_DEFAULTFREE(ptr)          SHY_FREE(ptr)
+#else
+#define SHYSTR_DEFAULTMALLOC(size)       malloc(size)
+#define SHYSTR_DEFAULTREALLOC(ptr, size) realloc(ptr, size)
+#define SHYSTR_DEFAULTFREE(ptr)          free(ptr)
+#endif
+
 #define SHYSTR_FMTBUF_SIZE 64
 
 enum SHYSTR_FmtFlags {
@@ -540,6 +591,61 @@ size_t SHYSTR_StrSize(const char *fmt, va_list args)
 	return size;
 }
 
+ShyAllocator SHYSTR_Allocator;
+
+void StrSetAllocator(const ShyAllocator *allocator)
+{
+	if (allocator && (!allocator->alloc != !allocator->release ||
+	                  (allocator->resize && !allocator->alloc))) {
+		fprintf(stderr, "Error setting allocator; alloc and release "
+		                "must both be set.\n");
+		return;
+	}
+	SHYSTR_Allocator = allocator ? *allocator : (ShyAllocator){0};
+}
+
+void *SHYSTR_Malloc(size_t size)
+{
+	if (SHYSTR_Allocator.alloc) {
+		return SHYSTR_Allocator.alloc(SHYSTR_Allocator.ctx, size);
+	}
+	return SHYSTR_DEFAULTMALLOC(size);
+}
+
+void SHYSTR_Free(void *ptr)
+{
+	if (!ptr) {
+		return;
+	} else if (SHYSTR_Allocator.release) {
+		SHYSTR_Allocator.release(SHYSTR_Allocator.ctx, ptr);
+	} else {
+		SHYSTR_DEFAULTFREE(ptr);
+	}
+}
+
+void *SHYSTR_Realloc(void *ptr, size_t old, size_t size)
+{
+	// Runtime allocators without resize are given a new buffer, into which
+	// the old bytes of ptr are copied.
+	if (SHYSTR_Allocator.resize) {
+		return SHYSTR_Allocator.resize(SHYSTR_Allocator.ctx, ptr, size);
+	} else if (!SHYSTR_Allocator.alloc) {
+		return SHYSTR_DEFAULTREALLOC(ptr, size);
+	}
+
+	void *grown = SHYSTR_Allocator.alloc(SHYSTR_Allocator.ctx, size);
+	if (grown && ptr) {
+		memcpy(grown, ptr, old < size ? old : size);
+		SHYSTR_Free(ptr);
+	}
+	return grown;
+}
+
+void StrFree(char *str)
+{
+	SHYSTR_Free(str);
+}
+
 char *SHYSTR_vStrCreate(const char *fmt, va_list args_orig)
 {
 	va_list args;
@@ -548,7 +654,7 @@ char *SHYSTR_vStrCreate(const char *fmt, va_list args_orig)
 	size_t size = SHYSTR_StrSize(fmt, args);
 	va_end(args);
 
-	char *str = malloc(size + 1);
+	char *str = SHYSTR_Malloc(size + 1);
 	if (!str) {
 		perror(strerror(errno));
 		return NULL;
@@ -594,14 +700,16 @@ bool SHYSTR_vStrAppend(char **dest_p, const char *fmt, va_list args)
 	size_t dest_len = strlen(dest);
 	size_t src_len  = strlen(src);
 
-	dest = realloc(dest, dest_len + src_len + 1);
+	dest = SHYSTR_Realloc(dest, dest_len + 1, dest_len + src_len + 1);
 	if (!dest) {
 		perror(strerror(errno));
+		SHYSTR_Free(src);
 		return false;
 	}
 	*dest_p = dest;
 
 	memcpy(dest + dest_len, src, src_len + 1);
+	SHYSTR_Free(src);
 
 	return true;
 }